@@ -41,24 +41,198 @@
 	06-28-2020	fixed bug in do_housekeeping()
 				version 0.20
 
+	10-16-2026	batched receive with recvmmsg(), adaptive batch size.
+				[general] rx_batch in dmrd.conf, rx counters in /STAT.
+				version 0.21
+
+	10-16-2026	talkgroup and scanner fan-out queued and sent with sendmmsg().
+				[general] tx_batch in dmrd.conf, tx batch size histogram in /STAT.
+				version 0.22
+
+	10-16-2026	epoll/timerfd reactor replaces select_rx() polling in run().
+				housekeeping, group owner timeouts and parrot playback are timers.
+				version 0.23
+
+	10-16-2026	optional io_uring data path, [general] io_backend = uring.
+				multishot recvmsg into provided buffers, fan-out as sendmsg submissions.
+				falls back to sockets when the kernel can't do it.
+				version 0.24
+
+	10-16-2026	[general] shards = N worker threads, each with a SO_REUSEPORT socket.
+				a reuseport BPF program steers each source address to its home shard.
+				fan-out to other shards' nodes goes through lock-free queues.
+				routing still takes the one state lock, so receive and send
+				scale with shards but routing doesn't. version 0.25
+
+	10-16-2026	sender pool for very large talkgroups, [general] fanout_threads and
+				fanout_threshold. frames are cut into chunks the senders claim in
+				parallel, sent from a refcounted snapshot of the subscribers.
+				version 0.26
+
+	10-16-2026	[general] pipeline = 1 splits each shard into RX, routing and TX threads
+				joined by cache line padded SPSC rings, [general] tx_threads.
+				queue depth and latency per stage in /STAT.
+				version 0.27
+
+	10-16-2026	control thread for RPTL, RPTK, RPTC, RPTCL and /STAT. hashing and
+				logging outside the state lock, DMRD no longer creates nodes.
+				version 0.28
+
+	10-16-2026	[general] busy_poll, busy_poll_us and cpu. data threads pinned to
+				cores and spinning on their sockets, loop/idle counts in /STAT.
+				version 0.29
+
+	10-16-2026	[general] socket_filter = shape | auth. kernel BPF filter drops
+				junk, and with auth DMRD from unauthenticated addresses.
+				version 0.30
+
+	10-16-2026	g_node_index replaced by hash tables sized to the live nodes.
+				findnode() only creates nodes when asked to. version 0.31
+
+	10-16-2026	g_active_nodes, packed list of every node for housekeeping and
+				the node dump. version 0.32
+
+	10-16-2026	timer wheel for node expiry, group and scanner owners, parrot
+				recording limit and playback. nodes expire on time instead of
+				at housekeeping. version 0.33
+
+	10-16-2026	slab pools for nodes, talkgroups, parrot recordings and fan-out
+				jobs. [general] hugepages, pool counts in /STAT. version 0.34
+
+	10-16-2026	refcounted packet buffers. datagrams are received into them and
+				shared by fan-out, shard and TX queues, io_uring sends and the
+				parrot instead of copied. [general] packet_buffers. version 0.35
+
+	10-16-2026	fan-out plans, each group keeps its destinations in one array by
+				slot, rebuilt when subscriptions change. all group and scanner
+				fan-out is sent from them. version 0.36
+
+	10-16-2026	stream cache, frames after the first of a group stream go from
+				their streamid straight to the group's plan. version 0.37
+
+	10-16-2026	[general] seq_filter = dup | late and seq_late. duplicate and late
+				group frames are dropped using the DMRD sequence number, with
+				counts per node and talkgroup. version 0.38
+
+	10-16-2026	stream quality, loss from sequence gaps and RFC 3550 jitter per
+				stream, logged at end of stream and totalled per node and
+				talkgroup in /STAT. version 0.39
+
+	10-16-2026	radio locations, every radio heard is kept with up to 4 slots it
+				was heard on, [general] radio_ttl. private calls are one lookup
+				for any radio and go to each place a roaming radio was heard.
+				version 0.40
+
+	10-16-2026	a slot can be subscribed to several groups, [general] slot_groups.
+				each group chains its subscriptions, keying up on another group
+				adds it instead of leaving the last one. version 0.41
+				a slot in more than one group gets one stream at a time, see
+				slot_takes(), and slot_groups defaults to 1 as before.
+
+	10-16-2026	static groups per node slot from [static] in dmrd.conf, kept while
+				the node is logged in. other subscriptions end after [general]
+				subscription_minutes without a keyup on the group. version 0.42
+
+	10-16-2026	talkgroups anywhere in the 24-bit ID space, kept in a hash and made
+				on the first keyup when [general] talkgroups allows the ID. groups
+				without subscribers are freed after [general] group_idle_minutes.
+				version 0.43
+
+	10-16-2026	talkgroup bridges from [bridges] in dmrd.conf. bridged groups share
+				one owner and one fan-out plan with every subscribed slot once.
+				version 0.44
+
+	10-16-2026	scanners from [scanner N] sections in dmrd.conf, each with include
+				and exclude ranges and a priority list. groups keep a list of the
+				scanners that follow them, groups nobody scans skip it all.
+				version 0.45
+
 */
 
 #include "dmrd.h"
 
 #define VERSION 0
-#define RELEASE 20
+#define RELEASE 45
 
 //#define BIG_ENDIAN_CPU
 #define LOW_DMRID 1000000			/* lowest acceptible DMR ID not including ESSID */
 #define HIGH_DMRID 8000000			/* highest acceptible DMR ID not including ESSID */
-#define MAX_TALK_GROUPS 10000		/* highest possible TG */
+#define HIGH_TG 0xFFFFFF			/* highest TG, DMRD has 24 bits for it */
+#define MAX_GROUPS 65536			/* talkgroups alive at once */
+#define MAX_TG_RANGES 32			/* ranges in [general] talkgroups */
+#define DEFAULT_TALKGROUPS "1-9999"	/* IDs a keyup may create a group for */
+#define DEFAULT_GROUP_IDLE_MINUTES 10	/* a made group is freed this long after its last subscriber leaves */
+#define MAX_BRIDGES 64				/* lines in [bridges] */
+#define MAX_BRIDGE_GROUPS 16		/* groups in one bridge */
+#define MAX_SCANNERS 16				/* [scanner N] sections */
+#define MAX_SCANNER_PRIORITY 16		/* groups in a scanner's priority list */
 #define TAC_TG_START 100			/* the first default TAC group to make */
 #define TAC_TG_END 109				/* the last default TAC group to make */
-#define SCANNER_TG 777				/* when radios connect to this, they head the 'scanner' */
+#define SCANNER_TG 777				/* when radios connect to this, they head the 'scanner', unless dmrd.conf has [scanner N] sections */
 #define UNSUBSCRIBE_ALL_TG 4000
 #define MAX_PASSWORD_SIZE 120
 #define DEFAULT_HOUSEKEEPING_MINUTES 1
 #define DEFAULT_PORT 62031
+#define MAX_RX_BATCH 256			/* most datagrams taken per recvmmsg() call */
+#define DEFAULT_RX_BATCH 32
+#define RX_BUFSIZE 1000
+#define MAX_TX_BATCH 256			/* most datagrams queued for one sendmmsg() flush */
+#define DEFAULT_TX_BATCH 64
+#define TX_HISTOGRAM 8				/* tx batch size buckets 1, 2-3, 4-7 .. 128+ */
+#define DMRD_SIZE 55
+#define IO_BACKEND_SOCKET 0			/* recvmmsg/sendmmsg on g_sock */
+#define IO_BACKEND_URING 1			/* io_uring, falls back to sockets */
+#define URING_RX_ENTRIES 64
+#define URING_RX_BUFFERS 512		/* provided receive buffers, power of 2 */
+#define URING_RX_BUFSIZE 1024
+#define URING_TX_SLOTS 1024			/* sends in flight */
+#define MAX_SHARDS 32				/* worker threads, one bit each in shard::wake */
+#define XSHARD_QUEUE_SIZE 1024		/* fan-out queue between two shards, power of 2 */
+#define MAX_FANOUT_THREADS 16		/* sender pool for very large groups */
+#define MAX_TX_THREADS 8			/* pipeline TX threads per shard */
+#define PIPE_RX_QUEUE 1024			/* RX thread to routing thread, power of 2 */
+#define PIPE_TX_QUEUE 4096			/* routing thread to each TX thread, power of 2 */
+#define CTL_QUEUE_SIZE 256			/* control packets waiting from each shard, power of 2 */
+#define CTL_PACKET_SIZE 302			/* largest control packet (RPTC) */
+#define DEFAULT_BUSY_POLL_US 50		/* SO_BUSY_POLL, us the kernel spins on the device queue */
+#define BUSY_POLL_EVENTS 64			/* busy poll iterations between checks for timers and other events */
+#define SOCKET_FILTER_OFF 0
+#define SOCKET_FILTER_SHAPE 1		/* classic BPF, drop datagrams that aren't MMDVM packets */
+#define SOCKET_FILTER_AUTH 2		/* extended BPF, also drop DMRD from unauthenticated addresses */
+#define MAX_AUTH_ADDRS 65536		/* authenticated addresses the kernel filter can hold */
+#define DEFAULT_FANOUT_THRESHOLD 1000	/* subscribers before a group's fan-out goes to the sender pool */
+#define MAX_FANOUT_JOBS 256			/* frames waiting for the sender pool before we send them ourselves */
+#define OWNER_TIMEOUT_MS 1500		/* group owner released after this much silence */
+#define PARROT_DELAY_MS 1000		/* pause before parrot playback */
+#define PARROT_FRAME_MS 20			/* parrot playback frame interval */
+#define PARROT_LIMIT_MS 6000		/* longest parrot recording */
+#define PARROT_FRAMES 128			/* frames a parrot recording holds, PARROT_LIMIT_MS of 60ms voice frames and then some */
+#define NODE_TIMEOUT_SECS 60		/* node must at least ping once a minute */
+#define WHEEL_TICK_MS 10			/* timer wheel resolution */
+#define MAX_STATUS_SIZE 1400		/* largest /STAT datagram, longer replies take several */
+#define STAT_WORST 4				/* streams and groups itemised in /STAT, the worst ones */
+#define MAX_STATUS_DATAGRAMS 8		/* a /STAT reply is cut off after this many */
+#define MAX_STATUS_NODES 64		/* nodes listed in /STAT, by dmrid */
+#define MAX_STREAMS 65536			/* group streams in the stream cache */
+#define STREAM_IDLE_SECS 5			/* housekeeping drops cached streams this quiet */
+#define SEQ_FILTER_OFF 0
+#define SEQ_FILTER_DUP 1			/* drop frames whose sequence number was already relayed */
+#define SEQ_FILTER_LATE 2			/* and frames more than g_seq_late behind the newest */
+#define DEFAULT_SEQ_LATE 6			/* one voice superframe */
+#define DMRD_FRAME_US 60000			/* a DMRD frame carries one 60 ms voice burst */
+#define RADIO_LOCATIONS 4			/* nodes a roaming radio is remembered on */
+#define DEFAULT_RADIO_TTL_SECS 900	/* a radio's location is forgotten after this long unheard */
+#define MAX_SLOT_GROUPS 64			/* groups one slot can be subscribed to */
+#define DEFAULT_SLOT_GROUPS 1			/* keying up on a group leaves the last one */
+#define SLOT_HOLD_MS 1000			/* a slot in several groups gets one stream until it's quiet this long */
+#define DEFAULT_SUBSCRIPTION_MINUTES 15	/* a keyed up group is left after this long without another keyup on it */
+#define DEFAULT_PACKET_BUFFERS 4096	/* refcounted packet buffers per shard */
+#define PKT_RX 0					/* packet buffer consumers, for the counters in /STAT */
+#define PKT_XSHARD 1
+#define PKT_PIPE 2
+#define PKT_URING 3
+#define PKT_FANOUT 4
+#define PKT_PARROT 5
 
 #define NODEID(SLOTID) ((SLOTID) & 0x7FFFFFFF)						/* strip off slot bit */
 #define SLOTID(NODEID,SLOT) ((NODEID) | ((SLOT) ? 0x80000000 : 0))	/* make a slotid */
@@ -69,21 +243,95 @@ int g_debug = 0;
 int g_udp_port = DEFAULT_PORT;
 char g_password[MAX_PASSWORD_SIZE];
 int g_housekeeping_minutes = DEFAULT_HOUSEKEEPING_MINUTES;
+int g_rx_batch = DEFAULT_RX_BATCH;		// configured max datagrams per receive call, 1 = one recvfrom() per datagram
+int g_tx_batch = DEFAULT_TX_BATCH;		// max datagrams per sendmmsg() call, 1 = one sendto() per datagram
+int g_io_backend = IO_BACKEND_SOCKET;	// [general] io_backend = socket | uring
+int g_shard_count = 1;					// [general] shards, threads each with their own SO_REUSEPORT socket
+int g_fanout_threads = 0;				// [general] fanout_threads, sender pool size, 0 = off
+int g_fanout_threshold = DEFAULT_FANOUT_THRESHOLD;	// [general] fanout_threshold
+int g_pipeline = 0;						// [general] pipeline, separate RX, routing and TX threads per shard
+int g_tx_threads = 1;					// [general] tx_threads, TX threads per shard when pipelined
+int g_busy_poll = 0;					// [general] busy_poll, spin on the socket instead of sleeping
+int g_busy_poll_us = DEFAULT_BUSY_POLL_US;	// [general] busy_poll_us
+int g_cpu = -1;							// [general] cpu, pin shard N's data thread to this + N, -1 = don't
+int g_socket_filter = SOCKET_FILTER_OFF;	// [general] socket_filter = off | shape | auth
+int g_hugepages = 0;					// [general] hugepages, object pools on 2 MB pages
+int g_packet_buffers = DEFAULT_PACKET_BUFFERS;	// [general] packet_buffers, per shard
+int g_seq_filter = SEQ_FILTER_OFF;		// [general] seq_filter = off | dup | late
+int g_seq_late = DEFAULT_SEQ_LATE;		// [general] seq_late, frames
+int g_radio_ttl = DEFAULT_RADIO_TTL_SECS;	// [general] radio_ttl, secs
+int g_slot_groups = DEFAULT_SLOT_GROUPS;	// [general] slot_groups, 1 = keying up on a group leaves the last one
+int g_subscription_minutes = DEFAULT_SUBSCRIPTION_MINUTES;	// [general] subscription_minutes, 0 = never
+std::string g_talkgroups_allowed = DEFAULT_TALKGROUPS;	// [general] talkgroups, ranges like 1-9999, 91, 310000-319999
+int g_group_idle_minutes = DEFAULT_GROUP_IDLE_MINUTES;	// [general] group_idle_minutes, 0 = keep them
 dword volatile g_tick;		// ticks since server started, this will rollover
 dword volatile g_sec;		// seconds since server started
 
 #define inet_ntoa __use_my_inet_ntoa__
 
+struct subscription;
+struct talkgroup;
+
 struct slot
 {
 	struct node		*node;				// parent node
 	dword			slotid;
-	dword			tg;					// subscribed talkgroup else 0
-	slot			*prev, *next;		// talkgroup chain of subscribers
-	dword			parrotstart;		// parrot start time
+	subscription	*subs;				// subscribed groups, most recently keyed first
+	int				groups;				// how many
+	int				statics;			// of them from [static]
+	dword			visit;				// g_visit_epoch when last put in a plan
+	talkgroup const	*rxfloor;			// floor of the stream it's getting, see slot_takes()
+	dword			rxtick;
+	wheel_timer		parrot_limit;		// ends the recording after PARROT_LIMIT_MS
+	bool			bParrotFull;		// recording hit the limit, ignore the rest of the stream
 	int				parrotendcount;	
-	memfile			*parrot;			// record parrot DMRD packets
+	struct parrot_rec	*parrot;		// record parrot DMRD packets
 	byte volatile	parrotseq;
+
+	slot() {
+
+		node = NULL;
+		slotid = 0;
+		subs = NULL;
+		groups = 0;
+		statics = 0;
+		visit = 0;
+		rxfloor = NULL;
+		rxtick = 0;
+		bParrotFull = false;
+		parrotendcount = 0;
+		parrot = NULL;
+		parrotseq = 0;
+	}
+};
+
+struct qos_stats		// finished streams, see stream_report()
+{
+	dword			streams;
+	dword			frames;
+	dword			lost;
+	dword			jitter;				// us, of the last stream
+	dword			maxjitter;			// us, worst stream
+
+	qos_stats() {
+
+		streams = 0;
+		frames = 0;
+		lost = 0;
+		jitter = 0;
+		maxjitter = 0;
+	}
+
+	void add (dword nframes, dword nlost, dword njitter) {
+
+		streams ++;
+		frames += nframes;
+		lost += nlost;
+		jitter = njitter;
+
+		if (njitter > maxjitter)
+			maxjitter = njitter;
+	}
 };
 
 struct node			// e.g, a pistar node
@@ -95,10 +343,23 @@ struct node			// e.g, a pistar node
 	dword			hitsec;				// last time heard
 	slot			slots[2];			// two slots
 	bool			bAuth;				// node has been authenticated
-
-	node() {
-
-		memset(this, 0, sizeof(*this));
+	int				active_ix;			// position in g_active_nodes
+	wheel_timer		expiry;				// checks hitsec NODE_TIMEOUT_SECS after it was last set
+	dword			seq_dups;			// frames dropped by the sequence filter
+	dword			seq_late;
+	qos_stats		qos;
+
+	node() {		// slots, expiry and qos have constructors of their own
+
+		nodeid = 0;
+		dmrid = 0;
+		salt = 0;
+		memset (&addr, 0, sizeof(addr));
+		hitsec = 0;
+		bAuth = false;
+		active_ix = 0;
+		seq_dups = 0;
+		seq_late = 0;
 
 		slots[0].node = this;
 		slots[1].node = this;
@@ -107,58 +368,310 @@ struct node			// e.g, a pistar node
 
 struct nodevector {
 
-	dword			radioslot;			// slot where the radio of the same dmrid was heard
-
-	struct node *sub[100];			// allocate for 100 ESSID
+	int				nodes;				// nodes with this dmrid, any ESSID
 
 	nodevector() {
 
+		nodes = 0;
+	}
+};
+
+struct radio_loc {
+
+	dword			slotid[RADIO_LOCATIONS];	// slots the radio was heard on, packed from the front
+	dword			sec[RADIO_LOCATIONS];		// when
+
+	radio_loc() {
+
 		memset (this, 0, sizeof(*this));
 	}
 };
 
-nodevector * g_node_index [HIGH_DMRID-LOW_DMRID];		// large array to point to nodevectors
+dword_map<node*> g_nodes;				// nodeid -> node
+dword_map<nodevector> g_node_vectors;	// dmrid -> nodevector, while it has nodes
+dword_map<radio_loc> g_radios;			// radioid -> where it was last heard, any 24-bit ID
+dword g_private_frames;					// private call frames routed by g_radios
+dword g_private_unrouted;				// and those to radios not heard within g_radio_ttl
+
+node **g_active_nodes = NULL;			// every node, packed. Deleting moves the last one into the hole
+int g_active_count = 0;
+int g_active_size = 0;
 
-// used for parrot processing
+// a parrot recording, references to the received frames
 
-struct parrot_exec
+struct parrot_rec
 {
-	sockaddr_in		addr;
-	memfile			*file;
+	sockaddr_in		addr;				// where playback goes
+	wheel_timer		timer;				// next frame
+	int				frames;				// recorded
+	int				played;
+	pkt_buf			*frame[PARROT_FRAMES];
 
-	parrot_exec() {
+	parrot_rec() {
 
-		file = NULL;
+		memset (&addr, 0, sizeof(addr));
+		frames = 0;
+		played = 0;
 	}
 
-	~parrot_exec() {
+	~parrot_rec() {
 
-		delete file;
-		file = NULL;
+		while (played < frames)
+			pkt_pool::release (frame[played++], PKT_PARROT);
 	}
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+struct fanout_list;
+struct talkgroup;
+
+struct scanner_ref		// one scanner that follows a group, see scanners_for()
+{
+	talkgroup		*sc;
+	int				prio;				// place in its priority list, npriority if not in it
+};
+
 struct talkgroup
 {	
 	dword		tg;					// talk group #
 	dword		ownerslot;			// slotid of owner else 0
 	dword		tick;				// clock tick (ms) of last audio packet from owner
-	slot		*subscribers;		// active listeners
+	talkgroup	*floor;				// has the owner, timer and plan of this group's bridge, itself if not bridged
+	talkgroup	*link;				// next group around the bridge, NULL if not bridged
+	talkgroup	*keyed;				// on the floor, the group its owner keyed up on
+	scanner_ref	*scanners;			// scanners that follow this group, see scanners_for()
+	int			nscanners;
+	bool		bScanner;			// this group is a scanner
+	int			scanprio;			// on a scanner, the priority of the stream it follows
+	subscription	*subscribers;	// active listeners
+	int			count;				// number of subscribers
+	fanout_list	*plan;				// destinations, NULL when there are none, see fanout_rebuild()
+	wheel_timer	owner_timer;		// releases a silent owner
+	wheel_timer	idle_timer;			// frees a group nobody has joined again, see group_idle_event()
+	bool		bKeep;				// scanner, TAC and static groups are never freed
+	dword		seq_dups;			// frames dropped by the sequence filter
+	dword		seq_late;
+	qos_stats	qos;
 
 	talkgroup() {
 		
 		tg = 0;	
 		ownerslot = 0;
 		tick = 0;
+		floor = this;
+		link = NULL;
+		keyed = this;
+		scanners = NULL;
+		nscanners = 0;
+		bScanner = false;
+		scanprio = 0;
 		subscribers = NULL;
+		count = 0;
+		plan = NULL;
+		bKeep = false;
+		seq_dups = 0;
+		seq_late = 0;
+	}
+
+	~talkgroup() {
+
+		delete [] scanners;
+	}
+};
+
+// One slot in one group. It is on the group's chain of subscribers, which fan-out plans
+// are made from, and on the slot's own list of its groups. Joining or leaving a group is
+// a few pointers on the chain, finding the subscription walks the slot's list, at most
+// g_slot_groups long plus its static groups. Static ones last as long as the node, the
+// others have a timer for g_subscription_minutes after the last keyup on the group.
+
+struct subscription
+{
+	slot			*s;
+	talkgroup		*g;
+	subscription	*prev, *next;		// group's chain of subscribers
+	subscription	*snext;				// slot's list of groups
+	bool			bStatic;			// from [static] in dmrd.conf
+	dword			sec;				// last keyup on the group
+	wheel_timer		timer;				// ends it, see subscription_timeout_event()
+};
+
+struct static_groups		// [static] groups of one node slot
+{
+	int				count;
+	dword			tg[MAX_SLOT_GROUPS];
+
+	static_groups() {
+
+		count = 0;
+	}
+};
+
+dword_map<static_groups> g_static_groups;	// slotid -> its static groups
+int g_static_subs;							// static subscriptions, all slots
+dword g_subscriptions_expired;				// by g_subscription_minutes
+
+// Talkgroups are kept in a hash by ID, so any 24-bit ID can be a group and memory goes
+// with the live ones. A keyup makes the group if g_tg_ranges allows its ID, and once its
+// last subscriber has gone for g_group_idle_minutes it is freed again.
+
+struct tg_range
+{
+	dword			low, high;
+};
+
+dword_map<talkgroup*> g_talkgroups;		// tg -> talkgroup
+tg_range g_tg_ranges[MAX_TG_RANGES];	// from g_talkgroups_allowed
+int g_tg_range_count;
+dword g_groups_made;					// by keyups
+dword g_groups_freed;					// idle
+
+// Bridges. The groups of a bridge are linked in a ring and share a floor, the first of
+// them: one talker at a time across the bridge, and one plan with the subscribers of all
+// of them. A slot subscribed to more than one is put in the plan once, by its visit stamp.
+
+struct bridge_def		// a [bridges] line
+{
+	std::string		name;
+	int				count;
+	dword			tg[MAX_BRIDGE_GROUPS];
+};
+
+bridge_def g_bridges[MAX_BRIDGES];
+int g_bridge_count;
+dword g_visit_epoch;					// stamps slot::visit while a plan is made
+
+// Scanners. Each [scanner N] section makes group N a scanner. It follows one stream at a
+// time from the groups in its include ranges less its exclude ranges, and a start of
+// stream on a group earlier in its priority list takes it from a later or unlisted one.
+// Which scanners want a group is worked out once, when the group is made, into the
+// group's scanners list, so a frame only looks at the scanners that follow its group.
+
+struct scanner_def		// a [scanner N] section
+{
+	dword			tg;
+	id_bitmap		groups;				// include less exclude
+	int				npriority;
+	dword			priority[MAX_SCANNER_PRIORITY];	// first is highest
+	talkgroup		*g;
+};
+
+scanner_def g_scanner_defs[MAX_SCANNERS];
+int g_scanner_count;
+
+// Stream cache. The first frames of a group stream go through all of handle_rx(), then
+// the stream is remembered by its streamid, and later frames from the same address and
+// slot go straight to the group's plan. Anything that could change where a stream goes
+// (subscriptions, group and scanner owners, logins and deleted nodes) bumps
+// g_stream_epoch, which makes every entry stale until its next frame has been through
+// handle_rx() again. End of stream removes the entry, housekeeping the ones left idle.
+
+struct stream_entry
+{
+	sockaddr_in		addr;				// where the stream comes from
+	dword			slotid;
+	slot			*s;
+	talkgroup		*g;
+	bool			bScanner;			// relayed to scanners the slot has as well
+	dword			epoch;				// g_stream_epoch when cached
+	dword			sec;				// last frame
+	byte			seq;				// newest sequence number
+	dword			seen;				// bit n set, seq - n has been received
+	dword			frames;				// received, duplicates and all
+	dword			lost;				// sequence numbers skipped, less those that turned up late
+	dword			jitter;				// RFC 3550 interarrival jitter, us * 16
+	dword			maxgap;				// longest interarrival, us
+	u64				first;				// GetMicroseconds() of the first and newest frames
+	u64				last;
+};
+
+dword_map<stream_entry> g_streams;		// streamid -> stream_entry
+dword g_stream_epoch = 1;
+dword g_stream_hits;					// frames sent from the cache
+dword g_stream_misses;					// voice frames that weren't
+dword g_seq_dropped_dups;				// by the sequence filter, all streams
+dword g_seq_dropped_late;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct rx_stats
+{
+	dword		calls;				// receive syscalls
+	dword		packets;			// datagrams received
+	dword		full;				// batches that came back full
+	dword		errors;				// receive errors
+	dword		junk;				// unknown datagrams dropped by the pipeline RX thread
+	int			batch;				// current adaptive batch size
+	int			peak;				// largest batch seen
+
+	rx_stats() {
+
+		memset (this, 0, sizeof(*this));
+
+		batch = 1;
 	}
 };
 
-talkgroup *g_talkgroups[MAX_TALK_GROUPS];
+struct tx_stats
+{
+	dword		calls;				// send syscalls
+	dword		packets;			// datagrams sent
+	dword		errors;				// send errors
+	dword		hist[TX_HISTOGRAM];	// send syscalls by batch size
+	dword		forwarded;			// fan-out handed to the destination's home shard
+	dword		ring_full;			// fan-out sent here because the home shard's or TX thread's queue was full
+
+	tx_stats() {
+
+		memset (this, 0, sizeof(*this));
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+reactor g_reactor;					// main thread event loop, owns shard 0 and the timers below
+
+reactor_event *g_housekeeping_timer;
+reactor_event *g_wheel_timer;		// turns g_wheel
+
+timer_wheel g_wheel;				// node expiry, group owners and parrots, under g_state_lock
+
+// the wheel turns every WHEEL_TICK_MS on the main thread while anything is on it
+
+dword wheel_tick ()
+{
+	return GetTickCount() / WHEEL_TICK_MS;
+}
+
+// (re)start a timer, ms from now. Caller holds g_state_lock
+
+void timer_start (wheel_timer *t, dword ms, REACTORPROC proc, void *cookie)
+{
+	if (!g_reactor.is_armed (g_wheel_timer)) {
+
+		g_wheel.reset (wheel_tick ());
+
+		g_reactor.set_timer (g_wheel_timer, WHEEL_TICK_MS, WHEEL_TICK_MS);
+	}
+
+	t->proc = proc;
+	t->cookie = cookie;
+
+	g_wheel.schedule (t, wheel_tick () + (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS);
+}
+
+// from its handler, ms after it was due rather than after now so a periodic timer doesn't drift
+
+void timer_repeat (wheel_timer *t, dword ms)
+{
+	g_wheel.schedule (t, t->due + ms / WHEEL_TICK_MS);
+}
 
-talkgroup *g_scanner;		// the scanner TG
+void timer_stop (wheel_timer *t)
+{
+	g_wheel.cancel (t);
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
@@ -219,7 +732,7 @@ bool select_rx (int sock, int wait_secs)
 	return !!ret;
 }
 
-int open_udp (int port)
+int open_udp (int port, bool bReusePort)
 {
 	int err;
 
@@ -232,6 +745,16 @@ int open_udp (int port)
 	
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*) &on, sizeof(on));
 
+#ifdef LINUX
+	if (bReusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char*) &on, sizeof(on)) == -1) {	// one socket per shard
+
+		err = errno;
+		CLOSESOCKET(sock);
+		errno = err;
+		return -1;
+	}
+#endif
+
 	sockaddr_in addr;
 
 	memset (&addr, 0, sizeof(addr));
@@ -262,6 +785,13 @@ int open_udp (int port)
 	return sock;
 }
 
+#ifdef LINUX
+dword GetTickCount()
+{
+	return (dword) (GetMicroseconds () / 1000);
+}
+#endif
+
 #ifdef WIN32
 int pthread_create (pthread_t *th, const pthread_attr_t *pAttr, PTHREADPROC pProc, void *pArg)
 {
@@ -522,7 +1052,7 @@ void init_process()
 #endif
 }
 
-void unsubscribe_from_group(slot *s);
+void unsubscribe_from_group(slot *s, bool bStatic=false);
 
 void log (sockaddr_in *addr, PCSTR fmt, ...)
 {
@@ -643,929 +1173,4757 @@ void show_packet (PCSTR title, char const *ip, byte const *pk, int sz, bool bSho
 	}
 }
 
-void sendpacket (sockaddr_in addr, void const *p, int sz)
+// Shards. Each shard is a thread with its own SO_REUSEPORT socket on the server port,
+// its own event loop and its own send and receive state. A reuseport BPF program sends
+// every source address to one shard, the node's home shard (see open_shards()).
+// Routing is done under g_state_lock by the shard that received the packet. Fan-out
+// to nodes homed on other shards is handed to them through lock-free queues, so each
+// node is sent to by the thread its traffic arrives on. Shard 0 runs on the main
+// thread along with the timers. Receiving and sending scale with the shards, routing
+// doesn't: every shard routes under the one g_state_lock, so with enough traffic the
+// shards queue on it and adding more stops helping.
+
+// fan-out queue entry. Destinations are queued with the buffer for their slot, then sent
+// with as few sendmmsg() calls as possible. The buffers must stay valid until tx_flush(),
+// anything that sends later takes a reference.
+
+struct tx_entry
 {
-	show_packet ("TX", my_inet_ntoa(addr.sin_addr).c_str(), (byte const*)p, sz, true);
+	sockaddr_in		addr;
+	pkt_buf			*pb;
+};
 
-	sendto (g_sock, (char*)p, sz, 0, (sockaddr*)&addr, sizeof(addr));
-}
+#ifdef LINUX
 
-node * findnode (dword nodeid, bool bCreateIfNecessary)
+// packet slots for recvmmsg(). A slot keeps its buffer from batch to batch until
+// somebody holds on to the datagram in it, then it gets a new one
+
+struct rx_slot
 {
-	node *n = NULL;
+	sockaddr_in		addr;
+	pkt_buf			*pb;
+};
 
-	nodeid = NODEID(nodeid);	// strip off possible slot bit
+#endif
+
+#ifdef HAVE_IO_URING
+
+struct uring_tx_slot
+{
+	msghdr			msg;
+	iovec			iov;
+	sockaddr_in		addr;
+	pkt_buf			*pb;				// held until the send completes
+	int				nextfree;
+};
+
+#endif
+
+struct xshard_packet		// fan-out queued for the destination's home shard, which releases pb
+{
+	sockaddr_in		addr;
+	pkt_buf			*pb;
+};
+
+#ifdef LINUX
+
+// Pipeline, [general] pipeline = 1. The shard's socket is read by an RX thread that
+// drops datagrams handle_rx() wouldn't recognize and queues the rest for the shard's
+// own thread, which routes them. Fan-out is queued for TX threads which do the sending,
+// so receiving, routing and sending overlap. A destination always goes to the same
+// TX thread to keep its frames in order.
+
+struct rx_packet			// RX thread to routing thread
+{
+	sockaddr_in		addr;
+	int				size;
+	u64				stamp;				// GetMicroseconds() when received
+	byte			buf[RX_BUFSIZE];
+};
+
+struct tx_desc				// routing thread to TX thread, which releases pb
+{
+	sockaddr_in		addr;
+	u64				stamp;				// GetMicroseconds() when queued
+	pkt_buf			*pb;
+};
 
-	dword dmrid, essid;
+struct stage_stats			// one pipeline queue, kept by its consumer
+{
+	dword			items;
+	dword			peak;				// most items waiting at once
+	u64				latency;			// total us items spent in the queue
+	dword			maxlatency;
 
-	if (nodeid > 0xFFFFFF) {	// has ESSID?
+	stage_stats() {
 
-		dmrid = nodeid / 100;
-		essid = nodeid % 100;
+		memset (this, 0, sizeof(*this));
 	}
 
-	else {
+	void depth (int n) {
 
-		dmrid = nodeid;
-		essid = 0;
+		if ((dword) n > peak)
+			peak = n;
 	}
 
-	if (!inrange(dmrid,LOW_DMRID,HIGH_DMRID)) 
-		return NULL;
+	void took (u64 now, u64 stamp) {
 
-	int ix = dmrid-LOW_DMRID;
+		dword us = (dword) (now - stamp);
 
-	if (!g_node_index[ix]) {
+		items ++;
+		latency += us;
 
-		g_node_index[ix] = new nodevector;
+		if (us > maxlatency)
+			maxlatency = us;
 	}
+};
 
- 	if (!g_node_index[ix]->sub[essid]) {
+struct tx_pipe
+{
+	spsc_ring<tx_desc> q;
+	int				fd;					// eventfd, signalled when q has descriptors
+	int				sock;
+	pthread_t		thread;
+	stage_stats		stage;
+	tx_stats		stats;
+	mmsghdr			msgs[MAX_TX_BATCH];
+	iovec			iov[MAX_TX_BATCH];
+};
 
-		n = g_node_index[ix]->sub[essid] = new node;
+#endif
 
-		n->nodeid = nodeid;
-		n->dmrid = dmrid;
+struct shard
+{
+	int				ix;						// index in g_shards
+	int				sock;					// SO_REUSEPORT socket, g_sock for shard 0
+	reactor			*r;						// event loop, &g_reactor for shard 0
+	reactor_event	*rx_event;				// sock, or the io_uring receive ring
+	pthread_t		thread;
+
+	rx_stats		rxstats;
+	tx_stats		txstats;
+
+	tx_entry		txq[MAX_TX_BATCH];		// fan-out queue, see tx_queue()
+	int				txq_count;
+
+	pkt_pool		pkts;					// received datagrams, see pkt_pool
+	pkt_buf			*frame[2];				// slot 1 and slot 2 versions of the packet being relayed
+	pkt_buf			*parts[MAX_BRIDGE_GROUPS][2];	// and for each group of a bridge, see member_variants()
+	pkt_buf			*copies[MAX_BRIDGE_GROUPS * 2];	// the ones made for that
+	int				ncopies;
+	pkt_buf			*rx_pb;					// for receive_single()
+	pkt_buf			rx_scratch;				// for when pkts runs out, can't be shared
+	pkt_buf			variant_scratch;
+
+#ifdef LINUX
+	mmsghdr			tx_msgs[MAX_TX_BATCH];
+	iovec			tx_iov[MAX_TX_BATCH];
+
+	rx_slot			*rx_slots;
+	mmsghdr			*rx_msgs;
+	iovec			*rx_iov;
+
+	spsc_ring<xshard_packet> *inbound;		// fan-out from each shard, indexed by sender
+	int				wakefd;					// eventfd, signalled when inbound has packets
+	reactor_event	*wake_event;
+	dword			wake;					// shards to signal on the next tx_flush(), bit per shard
+
+	spsc_ring<rx_packet> *rxq;				// pipeline RX thread to here, NULL when not pipelined
+	int				rxfd;					// eventfd, signalled when rxq has packets
+	pthread_t		rx_thread;
+	dword			rx_full;				// times the RX thread waited for room in rxq
+	stage_stats		rxstage;
+	tx_pipe			*txp;					// pipeline TX threads, [g_tx_threads]
+
+	u64				loops;					// busy poll iterations
+	u64				idle;					// busy poll iterations that found nothing
+#endif
 
-		n->slots[0].slotid = SLOTID(nodeid,0);
-		n->slots[1].slotid = SLOTID(nodeid,1);
-	}
+#ifdef HAVE_IO_URING
+	uring			rx_ring;
+	uring			tx_ring;
+	msghdr			uring_rx_msg;			// template for the multishot recvmsg
+	uring_tx_slot	*uring_tx;
+	int				uring_tx_free;			// free list of tx slots
+	bool			bUring;					// io_uring data path running
+#endif
 
-	else {
+	shard() {
+
+		ix = 0;
+		sock = -1;
+		r = NULL;
+		rx_event = NULL;
+		txq_count = 0;
+		frame[0] = NULL;
+		frame[1] = NULL;
+		ncopies = 0;
+		rx_pb = NULL;
+
+#ifdef LINUX
+		rx_slots = NULL;
+		rx_msgs = NULL;
+		rx_iov = NULL;
+		inbound = NULL;
+		wakefd = -1;
+		wake_event = NULL;
+		wake = 0;
+		rxq = NULL;
+		rxfd = -1;
+		rx_full = 0;
+		txp = NULL;
+		loops = 0;
+		idle = 0;
+#endif
 
-		n = g_node_index[ix]->sub[essid];
+#ifdef HAVE_IO_URING
+		uring_tx = NULL;
+		uring_tx_free = -1;
+		bUring = false;
+#endif
 	}
+};
 
-	return n;
-}
+shard g_shards[MAX_SHARDS];
 
-void delete_node (dword nodeid)
-{
-	nodeid = NODEID(nodeid);	// strip off possible slot
+THREADLOCAL shard *g_shard;		// shard of the calling thread
 
-	node *n = NULL;
+mutex g_state_lock;				// nodes, talkgroups and the timers, held while routing
 
-	int dmrid, essid;
+// the shard a node's packets are steered to, must match the program in open_shards()
 
-	if (nodeid > 0xFFFFFF) {
+shard * home_shard (sockaddr_in const &addr)
+{
+	return &g_shards[(dword) ntohl(getinaddr(addr)) % g_shard_count];
+}
 
-		dmrid = nodeid / 100;
-		essid = nodeid % 100;
-	}
+void sendpacket (sockaddr_in addr, void const *p, int sz)
+{
+	show_packet ("TX", my_inet_ntoa(addr.sin_addr).c_str(), (byte const*)p, sz, true);
 
-	else {
+	sendto (g_shard->sock, (char*)p, sz, 0, (sockaddr*)&addr, sizeof(addr));
+}
 
-		dmrid = nodeid;
-		essid = 0;
-	}
+void tx_count_batch (tx_stats &st, int n)
+{
+	int bucket = 0;
 
-	if (inrange(dmrid,LOW_DMRID,HIGH_DMRID)) {
+	while (bucket < TX_HISTOGRAM-1 && (2 << bucket) <= n)
+		bucket ++;
 
-		int ix = dmrid-LOW_DMRID;
+	st.hist[bucket] ++;
+	st.calls ++;
+}
 
-		if (g_node_index[ix]) {
+#ifdef LINUX
 
-			node *n = g_node_index[ix]->sub[essid];
+// send the first n queued datagrams with sendmmsg(), returns how many were handled
 
-			if (n) {
+int tx_sendmmsg (int n)
+{
+	int i;
 
-				log (&n->addr, "Delete node %d\n", nodeid);
+	for (i=0; i < n; i++) {
 
-				unsubscribe_from_group (&n->slots[0]);
+		g_shard->tx_iov[i].iov_base = g_shard->txq[i].pb->data;
+		g_shard->tx_iov[i].iov_len = g_shard->txq[i].pb->size;
 
-				unsubscribe_from_group (&n->slots[1]);
+		memset (&g_shard->tx_msgs[i].msg_hdr, 0, sizeof(g_shard->tx_msgs[i].msg_hdr));
 
-				g_node_index[ix]->sub[essid] = NULL;
+		g_shard->tx_msgs[i].msg_hdr.msg_name = &g_shard->txq[i].addr;
+		g_shard->tx_msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		g_shard->tx_msgs[i].msg_hdr.msg_iov = &g_shard->tx_iov[i];
+		g_shard->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-				bool bNodes = false;
+	i = 0;
 
-				for (int i=0; i < 100; i++) {
+	while (i < n) {
 
-					if (g_node_index[ix]->sub[essid]) {
+		int chunk = n - i < g_tx_batch ? n - i : g_tx_batch;
 
-						bNodes = true;
-						break;
-					}
-				}
+		int sent = sendmmsg (g_shard->sock, g_shard->tx_msgs + i, chunk, 0);
 
-				if (!bNodes) {
+		if (sent < 1) {
 
-					delete g_node_index[ix];
-					
-					g_node_index[ix] = NULL;
-				}
+			if (GetInetError() == ENOSYS) {		// kernel too old, back to sendto()
+
+				log (NULL, "sendmmsg not supported, batch send disabled\n");
 
-				delete n;
+				g_tx_batch = 1;
+				break;
 			}
+
+			g_shard->txstats.errors ++;	// the first datagram failed, skip it and carry on
+
+			sent = 1;
 		}
+
+		tx_count_batch (g_shard->txstats, sent);
+
+		i += sent;
 	}
+
+	return i;
 }
 
-slot * findslot (int slotid, bool bCreateIfNecessary)
-{
-	node *n = findnode (NODEID(slotid), bCreateIfNecessary);
+#endif
 
-	if (!n)
-		return NULL;
+#ifdef HAVE_IO_URING
 
-	return &n->slots[SLOT(slotid)];
-}
+// io_uring data path, per shard. Receives come from a multishot recvmsg on the shard's
+// socket that the kernel completes into a ring of provided buffers, sends are sendmsg
+// submissions from a pool of tx slots. Each direction has its own ring so reaping send
+// completions inside tx_flush() can never dispatch a received packet back into handle_rx().
 
-talkgroup * findgroup (dword tg, bool bCreateIfNecessary)
+bool uring_arm_recv ()
 {
-	if (!inrange(tg,1,MAX_TALK_GROUPS-1))
-		return NULL;
-
-	if (!g_talkgroups[tg] && bCreateIfNecessary) {
+	io_uring_sqe *sqe = g_shard->rx_ring.get_sqe();
 
-		g_talkgroups[tg] = new talkgroup;
+	if (!sqe)
+		return false;
 
-		g_talkgroups[tg]->tg = tg;
-	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = g_shard->sock;
+	sqe->addr = (unsigned long) &g_shard->uring_rx_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
 
-	return g_talkgroups[tg];
+	return g_shard->rx_ring.submit() >= 0;
 }
 
-void _dump_groups(std::string &ret)
+bool init_uring ()
 {
-	char temp[200];
+	if (!g_shard->rx_ring.init (URING_RX_ENTRIES, URING_RX_BUFFERS * 2) ||
+		!g_shard->rx_ring.setup_buffers (0, URING_RX_BUFFERS, URING_RX_BUFSIZE) ||
+		!g_shard->tx_ring.init (URING_TX_SLOTS, URING_TX_SLOTS * 2)) {
+
+		int err = errno;
+
+		g_shard->rx_ring.close_();
+		g_shard->tx_ring.close_();
 
-	for (int i=0; i < MAX_TALK_GROUPS; i++) {
+		errno = err;
+		return false;
+	}
 
-		talkgroup const *g = g_talkgroups[i];
+	memset (&g_shard->uring_rx_msg, 0, sizeof(g_shard->uring_rx_msg));
 
-		sprintf (temp, "TALKGROUP %d owner %d slot %d head %p %d\n", g->tg, NODEID(g->ownerslot), SLOT(g->ownerslot)+1, g->subscribers, g->subscribers ? g->subscribers->node->nodeid : 0);
+	g_shard->uring_rx_msg.msg_namelen = sizeof(sockaddr_in);
 
-		ret += temp;
+	g_shard->uring_tx = new uring_tx_slot[URING_TX_SLOTS];
 
-		slot *s = g->subscribers;
+	for (int i=0; i < URING_TX_SLOTS; i++) {
 
-		while (s) {
+		uring_tx_slot &t = g_shard->uring_tx[i];
 
-			sprintf (temp, "\t%p node %d slot %d prev %p next %p\n", s, s->node->nodeid, SLOT(s->slotid)+1, s->prev, s->next);
+		memset (&t.msg, 0, sizeof(t.msg));
 
-			ret += temp;
+		t.pb = NULL;
+		t.msg.msg_name = &t.addr;
+		t.msg.msg_namelen = sizeof(sockaddr_in);
+		t.msg.msg_iov = &t.iov;
+		t.msg.msg_iovlen = 1;
+		t.nextfree = g_shard->uring_tx_free;
 
-			s = s->next;
-		}
+		g_shard->uring_tx_free = i;
 	}
+
+	return uring_arm_recv ();
 }
 
-void dump_groups()
+// put finished tx slots back on the free list
+
+void uring_reap_tx ()
 {
-	if (g_debug) {
+	io_uring_cqe *cqe;
 
-		std::string str;
+	while ((cqe = g_shard->tx_ring.peek_cqe()) != NULL) {
 
-		puts (str.c_str());
-	}
-}
+		int ix = (int) cqe->user_data;
 
-void _dump_nodes(std::string &ret)
-{
-	char temp[200];
+		if (cqe->res < 0)
+			g_shard->txstats.errors ++;
 
-	sprintf (temp, "Sec %d tick %u\n", g_sec, g_tick);
+		g_shard->tx_ring.cqe_seen ();
 
-	ret += temp;
+		pkt_pool::release (g_shard->uring_tx[ix].pb, PKT_URING);
+
+		g_shard->uring_tx[ix].pb = NULL;
+		g_shard->uring_tx[ix].nextfree = g_shard->uring_tx_free;
 
-	for (int ix=0; ix < HIGH_DMRID - LOW_DMRID; ix++) {
+		g_shard->uring_tx_free = ix;
+	}
+}
 
-		if (g_node_index[ix]) {
+// submit the first n queued datagrams as sendmsg operations with one io_uring_enter().
+// Returns how many were taken, the rest (out of slots) go out with sendto().
 
-			sprintf (temp, "Node vector %d, radioslot %d\n", ix + LOW_DMRID, g_node_index[ix]->radioslot);
+int tx_uring (int n)
+{
+	uring_reap_tx ();
 
-			ret += temp;
+	int i;
 
-			for (int essid=0; essid < 100; essid++) {
+	for (i=0; i < n && g_shard->uring_tx_free != -1; i++) {
 
-				node const *n = g_node_index[ix]->sub[essid];
+		io_uring_sqe *sqe = g_shard->tx_ring.get_sqe();
 
-				if (n) {
+		if (!sqe || !g_shard->pkts.hold (g_shard->txq[i].pb, PKT_URING))
+			break;
 
-					sprintf (temp, "\t%s ID %d dmrid %d auth %d sec %u\n", my_inet_ntoa(n->addr.sin_addr).c_str(), n->nodeid, n->dmrid, n->bAuth, n->hitsec);
+		int ix = g_shard->uring_tx_free;
 
-					ret += temp;
+		uring_tx_slot &t = g_shard->uring_tx[ix];
 
-					if (n->slots[0].tg) {
+		g_shard->uring_tx_free = t.nextfree;
 
-						sprintf (temp, "\t\tS1 TG %d\n", n->slots[0].tg);
-						ret += temp;
-					}
+		t.addr = g_shard->txq[i].addr;
+		t.pb = g_shard->txq[i].pb;
+		t.iov.iov_base = t.pb->data;
+		t.iov.iov_len = t.pb->size;
 
-					if (n->slots[1].tg) {
-						
-						sprintf (temp, "\t\tS2 TG %d\n", n->slots[1].tg);
-						ret += temp;
-					}
-				}
-			}
-		}
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = g_shard->sock;
+		sqe->addr = (unsigned long) &t.msg;
+		sqe->len = 1;
+		sqe->user_data = ix;
 	}
-}
 
-void dump_nodes()
-{
-	if (g_debug) {
+	if (i) {
 
-		std::string str;
+		if (g_shard->tx_ring.submit() < 0)
+			g_shard->txstats.errors ++;
 
-		puts (str.c_str());
+		tx_count_batch (g_shard->txstats, i);
 	}
+
+	return i;
 }
 
-void unsubscribe_from_group(slot *s)
+#endif
+
+#ifdef LINUX
+
+// pipelined, hand the queued datagrams to the TX threads. Returns how many were taken,
+// a TX thread with a full queue is skipped and its datagrams go out with sendto()
+
+int tx_pipe_queue (int n)
 {
-	if (s->tg) {
+	u64 now = GetMicroseconds ();
+
+	dword wake = 0;
 
-		log (&s->node->addr, "Unsubscribe group %u node %d slot %d from talkgroup %d\n", s->tg, s->node->nodeid, SLOT(s->slotid)+1);
+	int i;
+
+	for (i=0; i < n; i++) {
 
-		talkgroup *g = findgroup (s->tg, false);
+		tx_entry &e = g_shard->txq[i];
 
-		// remove from subscriber list
+		int t = (int) ((dword) (getinaddr(e.addr) ^ e.addr.sin_port) % g_tx_threads);
 
-		if (g) {
+		tx_desc *d = g_shard->txp[t].q.reserve ();
 
-			if (g->ownerslot == s->slotid)		// if owner, release ownership
-				g->ownerslot = 0;
+		if (!d || !g_shard->pkts.hold (e.pb, PKT_PIPE)) {
 
-			if (s->prev)
-				s->prev->next = s->next;
+			if (sendto (g_shard->sock, (char*)e.pb->data, e.pb->size, 0, (sockaddr*)&e.addr, sizeof(sockaddr_in)) == -1)
+				g_shard->txstats.errors ++;
 
-			if (s->next)
-				s->next->prev = s->prev;
+			if (!d)
+				g_shard->txstats.ring_full ++;
 
-			if (g->subscribers == s)
-				g->subscribers = s->next;
+			tx_count_batch (g_shard->txstats, 1);
+			continue;
 		}
 
-		s->next = s->prev = NULL;
+		d->addr = e.addr;
+		d->stamp = now;
+		d->pb = e.pb;
 
-		s->tg = 0;
+		g_shard->txp[t].q.commit ();
 
-		dump_groups ();
+		wake |= 1 << t;
 	}
-}
 
-void subscribe_to_group(slot *s, talkgroup *g)
-{
-	if (s->tg != g->tg) {
+	for (i=0; wake; i++, wake >>= 1) {
 
-		log (&s->node->addr, "Subscribe group %u node %d slot %d to talkgroup %d\n", g->tg, s->node->nodeid, SLOT(s->slotid)+1);
+		if (wake & 1) {
 
-		unsubscribe_from_group(s);
-			
-		// insert at head of subscriber list for this group
+			u64 one = 1;
 
-		s->tg = g->tg;
-		s->prev = NULL;
-		s->next = g->subscribers;
+			write (g_shard->txp[i].fd, &one, sizeof(one));
+		}
+	}
 
-		if (s->next)
-			s->next->prev = s;
+	return n;
+}
 
-		g->subscribers = s;
+// signal the shards we queued fan-out for, so they send while we do our own
 
-		dump_groups ();
+void wake_shards ()
+{
+	for (int i=0; i < g_shard_count; i++) {
+
+		if (g_shard->wake & (1 << i)) {
+
+			u64 one = 1;
+
+			write (g_shards[i].wakefd, &one, sizeof(one));
+		}
 	}
+
+	g_shard->wake = 0;
 }
 
-void do_housekeeping()
+#endif
+
+void tx_flush ()
 {
-	dword t = g_sec;
+	int i, n = g_shard->txq_count;
 
-	dword starttick = g_tick;
+	g_shard->txq_count = 0;
 
-	log (NULL, "Housekeeping, tick %u\n", starttick);
+#ifdef LINUX
+	if (g_shard->wake)
+		wake_shards ();
+#endif
 
-	// delete any inactive nodes 
+	if (!n)
+		return;
 
-	int active = 0, dropped_nodes = 0, radios = 0, dropped_radios = 0;
+	g_shard->txstats.packets += n;
 
-	for (int ix=0; ix < HIGH_DMRID - LOW_DMRID; ix++) {
+	if (g_debug) {
 
-		for (int essid=0; g_node_index[ix] && essid < 100; essid++) {	// since g_node_index[ix] can go NULL in delete_node() we have to keep checking it every iteration
+		for (i=0; i < n; i++)
+			show_packet ("TX", my_inet_ntoa(g_shard->txq[i].addr.sin_addr).c_str(), g_shard->txq[i].pb->data, g_shard->txq[i].pb->size, true);
+	}
 
-			node const *n = g_node_index[ix]->sub[essid];
+	i = 0;
 
-			if (n) {
+#ifdef HAVE_IO_URING
+	if (g_shard->bUring)
+		i = tx_uring (n);
 
-				if (g_sec - n->hitsec >= 60) {		// node must at least ping once a minute
+	else
+#endif
+#ifdef LINUX
+	if (g_shard->txp)
+		i = tx_pipe_queue (n);
 
-					dropped_nodes ++;
+	else if (g_tx_batch > 1)
+		i = tx_sendmmsg (n);
+#endif
 
-					delete_node (n->nodeid);
-				}
+	for (; i < n; i++) {
 
-				else {
+		if (sendto (g_shard->sock, (char*)g_shard->txq[i].pb->data, g_shard->txq[i].pb->size, 0, (sockaddr*)&g_shard->txq[i].addr, sizeof(sockaddr_in)) == -1)
+			g_shard->txstats.errors ++;
 
-					active ++;
-				}
-			}
-		}
+		tx_count_batch (g_shard->txstats, 1);
 	}
-	
-	log (NULL, "Done - %u secs, %u active nodes, %u dropped nodes, %d radios, %d dropped radios, %u ticks\n", g_sec, active, dropped_nodes, radios, dropped_radios, g_tick - starttick);
 }
 
-void swapbytes (byte *a, byte *b, int sz)
+void tx_queue_local (sockaddr_in const &addr, pkt_buf *pb)
 {
-	while (sz--) 
-		swap (*a++, *b++);
-}
+	if (g_shard->txq_count == MAX_TX_BATCH)
+		tx_flush ();
 
-// Time thread. We don't use time() or any other time function in the C/C++ library for the "DMRD" packets
-// because they are expensive, and we want the highest performance.
-// This counter does not need to be perfectly accurate.
+	tx_entry &e = g_shard->txq[g_shard->txq_count++];
 
-PTHREAD_PROC(time_thread_proc) 
-{
-	for (;;) {
+	e.addr = addr;
+	e.pb = pb;
+}
 
-		Sleep (50);
+// queue a fan-out datagram. A destination homed on another shard goes on that shard's
+// queue with a reference to the buffer and is sent by it, unless the queue is full
 
-		g_tick += 50;
+void tx_queue (sockaddr_in const &addr, pkt_buf *pb)
+{
+#ifdef LINUX
+	if (g_shard_count > 1) {
 
-		if (!(g_tick % 1000))
-			g_sec ++;
-	}
+		shard *home = home_shard (addr);
 
-	return 0;
-}
+		if (home != g_shard) {
 
-// thread to playback a parrot recording
+			spsc_ring<xshard_packet> &q = home->inbound[g_shard->ix];
 
-PTHREAD_PROC(parrot_playback_thread_proc)
-{
-	parrot_exec *e = (parrot_exec*) threadcookie;
+			xshard_packet *p = q.reserve ();
 
-	e->file->Seek(0);
+			if (p && g_shard->pkts.hold (pb, PKT_XSHARD)) {
 
-	byte buf[55];
+				p->addr = addr;
+				p->pb = pb;
 
-	Sleep (1000);		// delay for a second
+				q.commit ();
 
-	while (e->file->Read (buf, 55)) {
+				g_shard->wake |= 1 << home->ix;
+				g_shard->txstats.forwarded ++;
 
-		sendpacket (e->addr, buf, 55);
+				return;
+			}
 
-		Sleep (20);
+			if (!p)
+				g_shard->txstats.ring_full ++;
+		}
 	}
+#endif
 
-	delete e;
-
-	return 0;
+	tx_queue_local (addr, pb);
 }
 
-// handle all received packets
+#ifdef LINUX
 
-void handle_rx (sockaddr_in &addr, byte *pk, int pksize)
+// fan-out from other shards for nodes homed here. The packets are sent straight
+// from the senders' buffers, and the slots and buffers given back once they're out
+
+void shard_wake_event (void *cookie)
 {
-	if (pksize == 55 && memcmp(pk, "DMRD", 4)==0) {		// DMR radio audio payload
+	u64 count;
 
-		dword const radioid = get3(pk + 5);	// radio ID
+	read (g_shard->wakefd, &count, sizeof(count));
 
-		dword const tg = get3 (pk + 8);	// tg or private call peer
+	for (int i=0; i < g_shard_count; i++) {
 
-		dword const nodeid = get4(pk + 11);	// the pistar ID
+		spsc_ring<xshard_packet> &q = g_shard->inbound[i];
 
-		dword const streamid = get4(pk + 16);		// stream ID
+		int n;
 
-		int const flags = pk[15];		// start/stop stream and frame number and slot
+		while ((n = q.avail ()) > 0) {
 
-		bool const bStartStream = (flags & 0x23) == 0x21;
+			if (n > MAX_TX_BATCH)
+				n = MAX_TX_BATCH;
 
-		bool const bEndStream = (flags & 0x23) == 0x22;
+			int j;
 
-		bool const bPrivateCall = (flags & 0x40) == 0x40;
+			for (j=0; j < n; j++) {
 
-		dword const slotid = SLOTID(nodeid, flags & 0x80);
+				xshard_packet const &p = q.at (j);
 
-		if (g_debug)
-			printf ("node %d slot %d radio %d group %d stream %08X flags %02X\n\n", nodeid, SLOT(slotid)+1, radioid, tg, streamid, flags);
+				tx_queue_local (p.addr, p.pb);
+			}
 
-		slot *s = findslot (slotid, true);
+			tx_flush ();
 
-		if (!s) {
+			for (j=0; j < n; j++)
+				pkt_pool::release (q.at (j).pb, PKT_XSHARD);
 
-			log (&addr, "Slotid %s not found for DMRD\n", slotid_str(slotid).c_str());
-			return;
+			q.consume (n);
 		}
+	}
+}
 
-		if (!s->node->bAuth) {		// node hasn't been authenticated?
+#endif
 
-			log (&addr, "Node %d not authenticated for DMRD\n", nodeid);
-			return;
-		}
+// make the slot 1 and slot 2 versions of a DMRD packet for fan-out, in g_shard->frame.
+// The talker's slot gets the received buffer itself, only the other slot needs a copy.
+// The copy is released once the packet is routed, see dispatch_rx()
 
-		if (getinaddr(s->node->addr) != getinaddr(addr)) {	// coming from a bogus IP?
+void make_slot_variants (pkt_buf *pb)
+{
+	int const own = (pb->data[15] & 0x80) ? 1 : 0;
 
-			log (&addr, "Node %d invalid IP DMRD. Should be %s\n", nodeid, my_inet_ntoa(addr.sin_addr).c_str());
-			return;
-		}
+	pkt_buf *other = g_shard->pkts.alloc ();
 
-		s->node->addr = addr;	// update IP
+	if (!other)
+		other = &g_shard->variant_scratch;
 
-		s->node->hitsec = g_sec;
+	memcpy (other->data, pb->data, pb->size);
 
-		if (inrange(radioid,LOW_DMRID,HIGH_DMRID) && g_node_index[radioid-LOW_DMRID])
-			g_node_index[radioid-LOW_DMRID]->radioslot = slotid;
+	other->size = pb->size;
+	other->data[15] ^= 0x80;
 
-		if (tg == UNSUBSCRIBE_ALL_TG) {		// unsubscribe only?
+	g_shard->frame[own] = pb;
+	g_shard->frame[!own] = other;
+}
 
-			if (bStartStream) {
+typedef pkt_buf *slot_variants[2];		// a packet for slot 1 and slot 2 destinations, see fanout_inline()
 
-				log (&addr, "Unsubscribe all, slotid %s\n", slotid_str(slotid).c_str());
-				unsubscribe_from_group (s);
-			}
+// Fan-out plans. Each group keeps its subscribers' addresses in one array, slot 1
+// destinations first, so a frame is sent without touching node memory: the slot 1
+// version of the packet to dest[0..split), the slot 2 version to the rest. A bridge's
+// plan has a part like that for each member group with subscribers, each sent a copy
+// of the packet with that group's TG. The plan is
+// rebuilt under g_state_lock as soon as the subscribers change or one of them moves,
+// routing only reads it. Plans are refcounted, the sender pool's jobs keep theirs while
+// subscriptions change. A plan nobody else holds is rewritten in place when it has
+// room, else one is taken from the plan pool, lists by size class that are handed out
+// again once released and never given back, so after warm-up nothing is allocated.
 
-			return;
-		}
+#define PLAN_CLASSES 24				/* plan size classes, room for 8 << class destinations */
 
-		if (bPrivateCall) {		// private call?
+struct fanout_dest
+{
+	sockaddr_in		addr;
+	dword			slotid;
+	slot			*shared;			// the slot, when it's in more than one group
+};
 
-			if (tg == radioid) {	// if to self, then this is a parrot
+struct fanout_part			// one member group's destinations, up to the next part's first
+{
+	dword			tg;
+	int				first;
+	int				split;				// first slot 2 destination
+};
 
-				if (bEndStream) {	// done?
+struct fanout_list			// a group's plan, shared with its jobs
+{
+	long volatile	refs;
+	int				count;
+	int				nshared;			// destinations with shared set
+	int				nparts;				// one unless bridged
+	fanout_part		part[MAX_BRIDGE_GROUPS];
+	int				size;				// size class
+	fanout_list		*next;				// while free
+	fanout_dest		*dest;
+};
 
-					log (&addr, "Parrot stream end on nodeid %u slotid %s radioid %u\n", nodeid, slotid_str(slotid).c_str(), radioid);
+inline int part_end (fanout_list const *l, int p)
+{
+	return p + 1 < l->nparts ? l->part[p+1].first : l->count;
+}
 
-					// is the parrot really running?
+fanout_list *g_plan_free[PLAN_CLASSES];	// released plans by size class, under g_plan_lock
+slab_stats g_plan_stats;
+mutex g_plan_lock;						// the last reference may go on a sender thread
+fanout_list g_no_plan = {1};			// groups nobody listens to, see fanout_plan()
 
-					if (s->parrot) {
+// a plan with room for total destinations, NULL if there's no memory for one
 
-						s->parrot->Write (pk, pksize);
+fanout_list * fanout_alloc_list (int total)
+{
+	int size = 0;
 
-						// hand it off to a parrot playback thread
+	while (size < PLAN_CLASSES && (8 << size) < total)
+		size ++;
 
-						parrot_exec *e = new parrot_exec;
+	g_plan_lock.lock ();
 
-						e->addr = s->node->addr;
-						e->file = s->parrot;
-						s->parrot = NULL;
+	fanout_list *l = size < PLAN_CLASSES ? g_plan_free[size] : NULL;
 
-						pthread_t th;
+	if (l)
+		g_plan_free[size] = l->next;
 
-						pthread_create (&th, NULL, parrot_playback_thread_proc, e);		// the thread will echo the packets back
-					}
-				}
+	else if (size < PLAN_CLASSES) {
 
-				else {
+		l = new fanout_list;
 
-					if (bStartStream) {	// start parrot?
+		l->size = size;
+		l->dest = (fanout_dest*) malloc ((8 << size) * sizeof(fanout_dest));
 
-						log (&addr, "Parrot stream start on nodeid %u slotid %s radioid %u\n", nodeid, slotid_str(slotid).c_str(), radioid);
+		if (l->dest)
+			g_plan_stats.capacity ++;
 
-						unsubscribe_from_group (s);
+		else {
 
-						// My pistar always has two flags==0xE1 packets, so it's possible we've already started the parrot
+			delete l;
+			l = NULL;
+		}
+	}
 
-						if (!s->parrot) {	
+	if (l) {
 
-							// fixme: make sure to purge this in the housekeeping if it's hanging around
+		g_plan_stats.allocs ++;
 
-							s->parrot = new memfile;
-							s->parrotseq ++;
-							s->parrotstart = g_sec;
-						}
-					}
+		if (++g_plan_stats.used > g_plan_stats.peak)
+			g_plan_stats.peak = g_plan_stats.used;
+	}
 
-					if (s->parrot && g_sec - s->parrotstart < 6) {		// limit duration
+	else
+		g_plan_stats.failed ++;
 
-						s->parrot->Write (pk, pksize);
-					}
-				}
-			}
+	g_plan_lock.unlock ();
 
-			else {		// private call
+	if (l)
+		l->refs = 1;
 
-				// see if we can locate the radio
+	return l;
+}
 
-				unsubscribe_from_group (s);
+void fanout_release_list (fanout_list *l)
+{
+	if (l && ATOMIC_ADD (&l->refs, -1) == 0) {
 
-				if (bStartStream) {
+		g_plan_lock.lock ();
 
-					log (&addr, "Private stream start, from radioid %u to radioid %u\n", radioid, tg);
-				}
+		l->next = g_plan_free[l->size];
+		g_plan_free[l->size] = l;
 
-				else if (bEndStream) {
+		g_plan_stats.used --;
 
-					log (&addr, "Private stream end, from radioid %u to radioid %u\n", radioid, tg);
-				}
+		g_plan_lock.unlock ();
+	}
+}
 
-				if (inrange(tg,LOW_DMRID,HIGH_DMRID)) {
-				
-					if (g_node_index[tg-LOW_DMRID]) {
+// a group's plan, its bridge's when it's bridged
 
-						dword slotid = g_node_index[tg-LOW_DMRID]->radioslot;
+inline fanout_list * fanout_plan (talkgroup const *g)
+{
+	return g->floor->plan ? g->floor->plan : &g_no_plan;
+}
 
-						slot const *dest = findslot (slotid, false);
+// subscribers changed or moved, make the plan again. A group nobody listens to any more
+// gives its plan back. Caller holds g_state_lock
 
-						if (dest) {
+void fanout_rebuild (talkgroup *g)
+{
+	g = g->floor;
 
-							if (bStartStream || bEndStream) {
+	talkgroup *m = g;
+	int total = 0;
 
-								log (&addr, "Private stream dest slotid %s found, from radioid %u to radioid %u\n", slotid_str(slotid).c_str(), radioid, tg);
-							}
+	do {
+		total += m->count;
+		m = m->link;
 
-							if (SLOT(slotid))
-								pk[15] |= 0x80;
+	} while (m && m != g);
 
-							else
-								pk[15] &= 0x7F;
+	fanout_list *l = g->plan;
 
-							sendpacket (dest->node->addr, pk, pksize);
-						}
+	if (!total || !l || l->refs > 1 || (8 << l->size) < total) {
 
-						else {
+		l = total ? fanout_alloc_list (total) : NULL;
 
-							if (bStartStream || bEndStream) {
+		if (total && !l) {
 
-								log (&addr, "Private stream dest slotid %s not found, from radioid %u to radioid %u\n", slotid_str(slotid).c_str(), radioid, tg);
-							}
-						}
-					}
+			log (NULL, "No memory for the plan of group %u\n", g->tg);
+			return;		// the old one is still safe to send from
+		}
 
-					else {
+		fanout_release_list (g->plan);
 
-						if (bStartStream || bEndStream) {
+		g->plan = l;
 
-							log (&addr, "Private stream dest radioid not in node index, from radioid %u to radioid %u\n", radioid, tg);
-						}
-					}
-				}
+		if (!l)
+			return;
+	}
 
-				else {
+	l->count = 0;
+	l->nshared = 0;
+	l->nparts = 0;
 
-					if (bStartStream || bEndStream) {
+	g_visit_epoch ++;
 
-						log (&addr, "Private stream dest radioid out of range, from radioid %u to radioid %u\n", radioid, tg);
-					}
-				}
-			}
-		}
+	m = g;
 
-		else {	// talkgroup 
+	do {
+		fanout_part &p = l->part[l->nparts];
 
-			talkgroup *g = findgroup (tg, false);
+		p.tg = m->tg;
+		p.first = l->count;
 
-			if (g) {	// group exists?
+		for (int slot2=0; slot2 < 2; slot2++) {
 
-				if (s->tg != tg) {	// not already subscribed?
-				
-					subscribe_to_group(s, g);
-				}
+			if (slot2)
+				p.split = l->count;
 
-				if (tg != SCANNER_TG) {
+			for (subscription const *sub = m->subscribers; sub; sub = sub->next) {
 
-					if (g->ownerslot && g_tick - g->tick >= 1500) {	// current group owner timed out?
+				slot *s = sub->s;
 
-						log (&addr, "Timeout group %u, slotid %s", tg, slotid_str(g->ownerslot).c_str());
+				if (SLOT(s->slotid) == slot2 && s->visit != g_visit_epoch) {
 
-						g->ownerslot = 0;
-					}
+					s->visit = g_visit_epoch;
 
-					if (bStartStream && !g->ownerslot) {
+					l->dest[l->count].addr = s->node->addr;
+					l->dest[l->count].slotid = s->slotid;
+					l->dest[l->count].shared = s->groups > 1 ? s : NULL;
+					l->count ++;
 
-						log (&addr, "Take group %u, nodeid %u slotid %s radioid %u", tg, nodeid, slotid_str(slotid).c_str(), radioid);
-							
-						g->ownerslot = slotid;
+					if (s->groups > 1)
+						l->nshared ++;
+				}
+			}
+		}
 
-						g->tick = g_tick;
-					}
+		if (l->count > p.first)
+			l->nparts ++;
 
-					else if (bEndStream && g->ownerslot == slotid) {
+		m = m->link;
 
-						log (&addr, "Drop group %u, nodeid %u slotid %s radioid %u", tg, nodeid, slotid_str(slotid).c_str(), radioid);
+	} while (m && m != g);
+}
 
-						g->ownerslot = 0;
-					}
-					
-					if (slotid == g->ownerslot) {
+// every change of a node's address goes through here. Plans hold a copy of it, so the
+// groups of a node that NAT moved to another port get new ones
+
+void node_moved (node *n, sockaddr_in const &addr)
+{
+	bool bMoved = getinaddr(n->addr) != getinaddr(addr) || n->addr.sin_port != addr.sin_port;
 
-						g->tick = g_tick;
+	n->addr = addr;
 
-						// relay packet to subscribers
+	for (int i=0; bMoved && i < 2; i++) {
 
-						slot const *dest = g->subscribers;
+		for (subscription const *sub = n->slots[i].subs; sub; sub = sub->snext)
+			fanout_rebuild (sub->g);
+	}
+}
 
-						while (dest) {
+// the packets for each part of g's plan, g_shard->frame when it has only the talker's
+// group. The other members of a bridge get copies with their own TG, released with the
+// frame. Without buffers for them they get the talker's
 
-							if (dest->slotid != slotid) {	// don't send packet back to sender
+slot_variants * member_variants (talkgroup const *g)
+{
+	fanout_list const *l = fanout_plan (g);
 
-								if (SLOT(dest->slotid))
-									pk[15] |= 0x80;
+	dword const tg = get3 (g_shard->frame[0]->data + 8);
 
-								else
-									pk[15] &= 0x7F;
+	if (l->nparts < 2 && (!l->nparts || l->part[0].tg == tg))
+		return &g_shard->frame;
 
-								sendpacket (dest->node->addr, pk, pksize);
-							}
+	for (int p=0; p < l->nparts; p++) {
 
-							dest = dest->next;
-						}
-					}
+		for (int j=0; j < 2; j++) {
 
-					if (g_scanner->ownerslot && g_tick - g_scanner->tick >= 1500) {
+			pkt_buf *pb = g_shard->frame[j];
 
-						log (&addr, "Timeout scanner, nodeid %u slotid %s radioid %u", nodeid, slotid_str(slotid).c_str(), radioid);
+			if (l->part[p].tg != tg && g_shard->ncopies < MAX_BRIDGE_GROUPS * 2) {
 
-						g_scanner->ownerslot = 0;
-					}
+				pkt_buf *copy = g_shard->pkts.alloc ();
 
-					// if slot owns scanner and end of stream, or owner timed out, drop ownership
+				if (copy) {
 
-					if (s->slotid == g_scanner->ownerslot && bEndStream) {
+					memcpy (copy->data, pb->data, pb->size);
 
-						log (&addr, "Drop scanner, nodeid %u slotid %s radioid %u", nodeid, slotid_str(slotid).c_str(), radioid);
+					copy->size = pb->size;
 
-						g_scanner->ownerslot = 0;
-					}
+					set3 (copy->data + 8, l->part[p].tg);
 
-					// if nobody owns the scanner, and this isn't the end of a stream, take tx ownership
+					g_shard->copies[g_shard->ncopies++] = pb = copy;
+				}
+			}
 
-					if (!g_scanner->ownerslot && !bEndStream) {
+			g_shard->parts[p][j] = pb;
+		}
+	}
 
-						log (&addr, "Take scanner, nodeid %u slotid %s radioid %u", nodeid, slotid_str(slotid).c_str(), radioid);
+	return g_shard->parts;
+}
 
-						g_scanner->ownerslot = s->slotid;
+// A slot in more than one group can only play one stream at a time. The first group
+// to send it a frame has it until that stream ends (see release_group()) or has been
+// quiet SLOT_HOLD_MS, the others' frames are skipped meanwhile. Caller holds
+// g_state_lock
 
-						g_scanner->tick = g_tick;
-					}
+bool slot_takes (slot *s, talkgroup const *floor)
+{
+	if (s->rxfloor && s->rxfloor != floor && g_tick - s->rxtick < SLOT_HOLD_MS)
+		return false;
 
-					// if current slot is current scanner stream, relay the packet to scanner subscribers
+	s->rxfloor = floor;
+	s->rxtick = g_tick;
 
-					if (s->slotid == g_scanner->ownerslot) {
+	return true;
+}
 
-						g_scanner->tick = g_tick;
+// send a frame to a group from its plan, except to the talker. variant has the packets
+// for each part of the plan. bShared sends only to the slots in more than one group,
+// what the sender pool leaves out
 
-						slot const *dest = g_scanner->subscribers;
+void fanout_inline (talkgroup *g, slot_variants const *variant, dword skip, bool bShared = false)
+{
+	fanout_list const *l = fanout_plan (g);
 
-						while (dest) {
+	if (bShared && !l->nshared)
+		return;
 
-							if (SLOT(dest->slotid))
-								pk[15] |= 0x80;
+	for (int p=0; p < l->nparts; p++) {
 
-							else
-								pk[15] &= 0x7F;
+		int const split = l->part[p].split, end = part_end (l, p);
 
-							sendpacket (dest->node->addr, pk, pksize);
-	
-							dest = dest->next;
-						}
-					}
-				}
-			}
+		for (int i=l->part[p].first; i < end; i++) {
 
-			else {
+			fanout_dest const &d = l->dest[i];
 
-				if (bStartStream)
-					log (&addr, "Nodeid %u keyup on non-existent group %u", nodeid, tg);
+			if (d.slotid == skip || (bShared && !d.shared))
+				continue;
 
-				unsubscribe_from_group (s);
-			}
+			if (!d.shared || slot_takes (d.shared, g->floor))
+				tx_queue (d.addr, variant[p][i >= split]);
 		}
 	}
+}
 
-	else if (pksize == 8 && memcmp(pk, "RPTL", 4)==0) {		// login
-
-		dword nodeid = get4(pk + 4);
-
-		log (&addr, "RPTL node %d\n", nodeid);
+// Sender pool for very large talkgroups. A frame for a group with at least
+// g_fanout_threshold subscribers is posted as a job instead of being sent by the shard
+// that routed it. The job is cut into chunks of g_tx_batch destinations, and the sender
+// threads claim chunks with an atomic index, so however many of them wake up share the
+// work. Chunk n of two frames goes to the same destinations, so the next job isn't
+// started until every chunk of the current one has been sent, not just claimed: the
+// sender that finishes the last chunk takes the job off the queue and wakes the others
+// for the next. Jobs send from the group's plan.
 
-		node *n = findnode (nodeid, false);
+struct fanout_job
+{
+	long volatile	refs;				// the queue, and each sender working on it
+	fanout_list		*list;
+	dword			skip;				// talker's slotid
+	int				sock;				// socket of the shard that routed it
+	slot_variants	variant[MAX_BRIDGE_GROUPS];	// for each part of the plan, held for the job
+	long volatile	next;				// next chunk to claim
+	long volatile	done;				// chunks sent
+	long			chunks;
+	fanout_job		*qnext;
+};
 
-		if (n) {		// node exists?
+struct fanout_worker
+{
+	pthread_t		thread;
+	dword			chunks;				// chunks sent by this thread
+	dword			packets;
+	dword			errors;
+
+#ifdef LINUX
+	mmsghdr			msgs[MAX_TX_BATCH];
+	iovec			iov[MAX_TX_BATCH];
+#endif
+};
 
-			// if already authenticated at a different IP then reject
+slab_pool<node> g_node_pool;				// the first four under g_state_lock
+slab_pool<talkgroup> g_talkgroup_pool;
+slab_pool<subscription> g_subscription_pool;
+slab_pool<parrot_rec> g_parrot_pool;
+slab_pool<fanout_job> g_fanout_job_pool;	// under g_fanout_lock
+
+fanout_worker *g_fanout_workers;
+fanout_job *g_fanout_head, *g_fanout_tail;		// jobs waiting, under g_fanout_lock
+int g_fanout_queued;
+mutex g_fanout_lock;
+semaphore g_fanout_sem;
+dword g_fanout_jobs;			// frames posted to the pool
+dword g_fanout_busy;			// frames sent inline because the pool was backed up
+
+void fanout_release_job (fanout_job *job)
+{
+	if (ATOMIC_ADD (&job->refs, -1) == 0) {
 
-			if (n->bAuth && getinaddr(addr) != getinaddr(n->addr)) {
+		for (int p=0; p < job->list->nparts; p++) {
 
-				log (&addr, "Node %d already logged in at %s\n", nodeid, my_inet_ntoa(n->addr.sin_addr).c_str());
-				return;
-			}
+			pkt_pool::release (job->variant[p][0], PKT_FANOUT);
+			pkt_pool::release (job->variant[p][1], PKT_FANOUT);
 		}
 
-		if (!n) {
+		fanout_release_list (job->list);
 
-			n = findnode (nodeid, true);
-		}
+		g_fanout_lock.lock ();
 
-		n->hitsec = g_sec;
+		g_fanout_job_pool.free (job);
 
-		if (!getinaddr(n->addr)) {
+		g_fanout_lock.unlock ();
+	}
+}
 
-			n->addr = addr;
-		}
+// hand a frame for g to the sender pool. Returns false if the pool is backed up
 
-		n->salt = ((dword)rand() << 16) ^ g_tick;	// reasonably random salt for RPTK authentication
+// drop the job's hold on the first n packets of variant
 
-		memcpy (pk, "RPTACK", 6);
+void fanout_unhold (slot_variants const *variant, int n)
+{
+	for (int k=0; k < n; k++)
+		pkt_pool::release (variant[k / 2][k % 2], PKT_FANOUT);
+}
 
-		*(dword*)(pk + 6) = n->salt;
+bool fanout_post (talkgroup *g, slot_variants const *variant, dword skip)
+{
+	if (g_fanout_queued >= MAX_FANOUT_JOBS) {
 
-		sendpacket (addr, pk, 10);
+		g_fanout_busy ++;
+		return false;
 	}
 
-	else if (pksize == 40 && memcmp(pk, "RPTK", 4)==0) {		// authentication data
+	fanout_list *l = fanout_plan (g);
 
-		dword nodeid = get4(pk + 4);
+	int held;
 
-		log (&addr, "RPTK node %d\n", nodeid);
+	for (held=0; held < l->nparts * 2; held++) {
 
-		node *n = findnode(nodeid, false);
+		if (!g_shard->pkts.hold (variant[held / 2][held % 2], PKT_FANOUT)) {
 
-		if (!n) {
+			fanout_unhold (variant, held);
 
-			log (&addr, "Node %d not found for RPTK", nodeid);
-			return;
+			g_fanout_busy ++;
+			return false;
 		}
+	}
 
-		if (getinaddr(n->addr) != getinaddr(addr)) {
+	g_fanout_lock.lock ();
 
-			log (&addr, "Invalid RPTK IP address for node %d, should be %s\n", nodeid, my_inet_ntoa(n->addr.sin_addr).c_str());
-			return;
-		}
+	fanout_job *job = g_fanout_job_pool.alloc ();
 
-		n->hitsec = g_sec;
+	if (!job) {
 
-		if (!n->bAuth) {
+		g_fanout_lock.unlock ();
 
-			byte const * remotehash = pk + 8;
+		fanout_unhold (variant, held);
 
-			byte localhash[32];
+		g_fanout_busy ++;
+		return false;
+	}
 
-			char temp[MAX_PASSWORD_SIZE + 10];
-			
-			*(dword*)temp = n->salt;
+	job->refs = 1;
+	job->list = l;
+	job->skip = skip;
+	job->sock = g_shard->sock;
 
-			strcpy (temp + sizeof(n->salt), g_password);
+	for (int p=0; p < l->nparts; p++) {
 
-			make_sha256_hash (temp, sizeof(n->salt) + strlen(g_password), localhash, NULL, 0);
+		job->variant[p][0] = variant[p][0];
+		job->variant[p][1] = variant[p][1];
+	}
+
+	job->next = 0;
+	job->done = 0;
+	job->chunks = (job->list->count + g_tx_batch - 1) / g_tx_batch;
+	job->qnext = NULL;
+
+	ATOMIC_ADD (&job->list->refs, 1);
+
+	bool bHead = !g_fanout_tail;		// else the last sender of the job ahead starts it
+
+	if (g_fanout_tail)
+		g_fanout_tail->qnext = job;
+	else
+		g_fanout_head = job;
+
+	g_fanout_tail = job;
+	g_fanout_queued ++;
+
+	g_fanout_lock.unlock ();
+
+	g_fanout_jobs ++;
+
+	if (bHead)
+		g_fanout_sem.post (job->chunks < g_fanout_threads ? job->chunks : g_fanout_threads);
+
+	return true;
+}
+
+// the oldest job, with a reference for the caller
+
+fanout_job * fanout_take ()
+{
+	g_fanout_lock.lock ();
+
+	fanout_job *job = g_fanout_head;
+
+	if (job)
+		ATOMIC_ADD (&job->refs, 1);
+
+	g_fanout_lock.unlock ();
+
+	return job;
+}
+
+// the last chunk of the job at the head of the queue has been sent, take it off and
+// wake senders for the next one. The caller still holds its own reference
+
+void fanout_retire (fanout_job *job)
+{
+	g_fanout_lock.lock ();
+
+	g_fanout_head = job->qnext;
+
+	if (!g_fanout_head)
+		g_fanout_tail = NULL;
+
+	g_fanout_queued --;
+
+	long chunks = g_fanout_head ? g_fanout_head->chunks : 0;
+
+	g_fanout_lock.unlock ();
+
+	fanout_release_job (job);		// the queue's reference
+
+	if (chunks)
+		g_fanout_sem.post (chunks < g_fanout_threads ? chunks : g_fanout_threads);
+}
+
+void fanout_send_chunk (fanout_worker *w, fanout_job *job, long chunk)
+{
+	fanout_list const *l = job->list;
+
+	int first = chunk * g_tx_batch;
+	int last = first + g_tx_batch < l->count ? first + g_tx_batch : l->count;
+	int i, n = 0, p = 0;		// p is the part of the plan i is in
+
+#ifdef LINUX
+	for (i=first; i < last; i++) {
+
+		fanout_dest const &d = l->dest[i];
+
+		while (i >= part_end (l, p))
+			p ++;
+
+		if (d.slotid == job->skip || d.shared)	// not back to the sender, and shared slots were sent inline
+			continue;
+
+		pkt_buf const *pb = job->variant[p][i >= l->part[p].split];
+
+		w->iov[n].iov_base = (void*) pb->data;
+		w->iov[n].iov_len = pb->size;
+
+		memset (&w->msgs[n].msg_hdr, 0, sizeof(w->msgs[n].msg_hdr));
+
+		w->msgs[n].msg_hdr.msg_name = (void*) &d.addr;
+		w->msgs[n].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		w->msgs[n].msg_hdr.msg_iov = &w->iov[n];
+		w->msgs[n].msg_hdr.msg_iovlen = 1;
+
+		n ++;
+	}
+
+	i = 0;
+
+	while (i < n) {
+
+		int sent = sendmmsg (job->sock, w->msgs + i, n - i, 0);
+
+		if (sent < 1) {
+
+			w->errors ++;	// the first datagram failed, skip it and carry on
+
+			sent = 1;
+		}
+
+		i += sent;
+	}
+#else
+	for (i=first; i < last; i++) {
+
+		fanout_dest const &d = l->dest[i];
+
+		while (i >= part_end (l, p))
+			p ++;
+
+		if (d.slotid == job->skip || d.shared)
+			continue;
+
+		pkt_buf const *pb = job->variant[p][i >= l->part[p].split];
+
+		if (sendto (job->sock, (char*) pb->data, pb->size, 0, (sockaddr*)&d.addr, sizeof(sockaddr_in)) == -1)
+			w->errors ++;
+
+		n ++;
+	}
+#endif
+
+	w->chunks ++;
+	w->packets += n;
+}
+
+PTHREAD_PROC(fanout_thread_proc)
+{
+	fanout_worker *w = (fanout_worker*) threadcookie;
+
+	for (;;) {
+
+		g_fanout_sem.wait ();
+
+		fanout_job *job;
+
+		while ((job = fanout_take ()) != NULL) {
+
+			long chunk, sent = 0;
+
+			while ((chunk = ATOMIC_ADD (&job->next, 1) - 1) < job->chunks) {
+
+				fanout_send_chunk (w, job, chunk);
+
+				sent ++;
+
+				if (ATOMIC_ADD (&job->done, 1) == job->chunks)
+					fanout_retire (job);
+			}
+
+			fanout_release_job (job);
+
+			if (!sent)
+				break;		// the rest is being sent, whoever sends the last chunk wakes us
+		}
+	}
+
+	return 0;
+}
+
+void start_fanout_threads ()
+{
+	if (g_fanout_threads < 1)
+		return;
+
+	g_fanout_workers = new fanout_worker[g_fanout_threads];
+
+	memset (g_fanout_workers, 0, sizeof(fanout_worker) * g_fanout_threads);
+
+	for (int i=0; i < g_fanout_threads; i++)
+		pthread_create (&g_fanout_workers[i].thread, NULL, fanout_thread_proc, &g_fanout_workers[i]);
+}
+
+// kernel socket filters. Datagrams that aren't one of the MMDVM packets we handle
+// are dropped before they are copied to us, and with socket_filter = auth so is
+// DMRD from any address no node has authenticated from
+
+#define BPF_TAG(S) ((dword)(S)[0] << 24 | (dword)(S)[1] << 16 | (dword)(S)[2] << 8 | (dword)(S)[3])	// first 4 bytes as a BPF word load sees them
+#define BPF_UDP(SZ) ((SZ) + 8)				// the filter sees the UDP header as well
+#define BPF_JUMP_TO(AT,TO) ((TO) - (AT) - 1)	// relative jump from instruction AT to TO
+
+std::map<dword,int> g_auth_addrs;	// authenticated nodes per address (host order), under g_state_lock
+
+#ifdef HAVE_EBPF
+int g_auth_map = -1;				// kernel copy of g_auth_addrs
+
+long sys_bpf (int cmd, bpf_attr &attr)
+{
+	return syscall (__NR_bpf, cmd, &attr, sizeof(attr));
+}
+#endif
+
+// a node has just authenticated
+
+void auth_filter_add (sockaddr_in const &addr)
+{
+	if (g_socket_filter != SOCKET_FILTER_AUTH)
+		return;
+
+	dword ip = ntohl (getinaddr (addr));
+
+	if (g_auth_addrs[ip]++)
+		return;
+
+#ifdef HAVE_EBPF
+	dword one = 1;
+
+	bpf_attr attr;
+
+	memset (&attr, 0, sizeof(attr));
+
+	attr.map_fd = g_auth_map;
+	attr.key = (u64) (unsigned long) &ip;
+	attr.value = (u64) (unsigned long) &one;
+	attr.flags = BPF_ANY;
+
+	if (sys_bpf (BPF_MAP_UPDATE_ELEM, attr) == -1)
+		log ((sockaddr_in*) &addr, "Can't add address to the socket filter (%d)\n", GetInetError());
+#endif
+}
+
+// an authenticated node is being deleted
+
+void auth_filter_remove (sockaddr_in const &addr)
+{
+	if (g_socket_filter != SOCKET_FILTER_AUTH)
+		return;
+
+	dword ip = ntohl (getinaddr (addr));
+
+	std::map<dword,int>::iterator it = g_auth_addrs.find (ip);
+
+	if (it == g_auth_addrs.end() || --it->second > 0)
+		return;
+
+	g_auth_addrs.erase (it);
+
+#ifdef HAVE_EBPF
+	bpf_attr attr;
+
+	memset (&attr, 0, sizeof(attr));
+
+	attr.map_fd = g_auth_map;
+	attr.key = (u64) (unsigned long) &ip;
+
+	sys_bpf (BPF_MAP_DELETE_ELEM, attr);
+#endif
+}
+
+#ifdef LINUX
+bool attach_shape_filter ()
+{
+	enum {SHAPE = 6, DMRD = 14, RPTL = 16, RPTK = 18, RPTC = 20, PING = 22, RPTCL = 26, DROP = 30, ACCEPT = 31};
+
+	sock_filter code[] = {
+
+		{BPF_LD | BPF_W | BPF_LEN, 0, 0, 0},
+		{BPF_JMP | BPF_JGE | BPF_K, 0, BPF_JUMP_TO(1,SHAPE), BPF_UDP(5)},
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, BPF_UDP(0)},
+		{BPF_JMP | BPF_JEQ | BPF_K, 0, BPF_JUMP_TO(3,SHAPE), BPF_TAG("/STA")},
+		{BPF_LD | BPF_B | BPF_ABS, 0, 0, BPF_UDP(4)},
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(5,ACCEPT), 0, 'T'},
+
+		{BPF_LD | BPF_W | BPF_LEN, 0, 0, 0},	// SHAPE, the rest have fixed sizes
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(7,DMRD), 0, BPF_UDP(55)},
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(8,RPTL), 0, BPF_UDP(8)},
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(9,RPTK), 0, BPF_UDP(40)},
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(10,RPTC), 0, BPF_UDP(302)},
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(11,PING), 0, BPF_UDP(11)},
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(12,RPTCL), 0, BPF_UDP(9)},
+		{BPF_RET | BPF_K, 0, 0, 0},
+
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, BPF_UDP(0)},	// DMRD
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(15,ACCEPT), BPF_JUMP_TO(15,DROP), BPF_TAG("DMRD")},
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, BPF_UDP(0)},	// RPTL
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(17,ACCEPT), BPF_JUMP_TO(17,DROP), BPF_TAG("RPTL")},
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, BPF_UDP(0)},	// RPTK
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(19,ACCEPT), BPF_JUMP_TO(19,DROP), BPF_TAG("RPTK")},
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, BPF_UDP(0)},	// RPTC
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(21,ACCEPT), BPF_JUMP_TO(21,DROP), BPF_TAG("RPTC")},
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, BPF_UDP(0)},	// PING
+		{BPF_JMP | BPF_JEQ | BPF_K, 0, BPF_JUMP_TO(23,DROP), BPF_TAG("RPTP")},
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, BPF_UDP(3)},
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(25,ACCEPT), BPF_JUMP_TO(25,DROP), BPF_TAG("PING")},
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, BPF_UDP(0)},	// RPTCL
+		{BPF_JMP | BPF_JEQ | BPF_K, 0, BPF_JUMP_TO(27,DROP), BPF_TAG("RPTC")},
+		{BPF_LD | BPF_B | BPF_ABS, 0, 0, BPF_UDP(4)},
+		{BPF_JMP | BPF_JEQ | BPF_K, BPF_JUMP_TO(29,ACCEPT), BPF_JUMP_TO(29,DROP), 'L'},
+
+		{BPF_RET | BPF_K, 0, 0, 0},				// DROP
+		{BPF_RET | BPF_K, 0, 0, 0xFFFFFFFF},	// ACCEPT
+	};
+
+	sock_fprog prog;
+
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+
+	for (int i=0; i < g_shard_count; i++) {
+
+		if (setsockopt (g_shards[i].sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1) {
+
+			log (NULL, "Can't attach socket filter (%d)\n", GetInetError());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+#ifdef HAVE_EBPF
+#define EBPF(CODE,DST,SRC,OFF,IMM) {(byte) (CODE), (DST), (SRC), (short) (OFF), (int) (IMM)}
+
+// same shapes as attach_shape_filter(), and DMRD source address must be in g_auth_map
+
+bool attach_auth_filter ()
+{
+	bpf_attr attr;
+
+	memset (&attr, 0, sizeof(attr));
+
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = sizeof(dword);
+	attr.value_size = sizeof(dword);
+	attr.max_entries = MAX_AUTH_ADDRS;
+
+	if ((g_auth_map = sys_bpf (BPF_MAP_CREATE, attr)) == -1) {
+
+		log (NULL, "Can't create socket filter map (%d)\n", GetInetError());
+		return false;
+	}
+
+	enum {SHAPE = 8, DROP = 14, ACCEPT = 16, RPTL = 18, RPTK = 21, RPTC = 24, PING = 27, RPTCL = 32, DMRD = 37};
+
+	bpf_insn code[] = {
+
+		EBPF(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),			// r6 = skb, for the packet loads
+		EBPF(BPF_LDX | BPF_MEM | BPF_W, 7, 6, offsetof(__sk_buff,len), 0),
+		EBPF(BPF_JMP | BPF_JGE | BPF_K, 7, 0, 1, BPF_UDP(5)),
+		EBPF(BPF_JMP | BPF_JA, 0, 0, BPF_JUMP_TO(3,SHAPE), 0),
+		EBPF(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, BPF_UDP(0)),
+		EBPF(BPF_JMP | BPF_JNE | BPF_K, 0, 0, BPF_JUMP_TO(5,SHAPE), BPF_TAG("/STA")),
+		EBPF(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, BPF_UDP(4)),
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, BPF_JUMP_TO(7,ACCEPT), 'T'),
+
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 7, 0, BPF_JUMP_TO(8,DMRD), BPF_UDP(55)),	// SHAPE
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 7, 0, BPF_JUMP_TO(9,RPTL), BPF_UDP(8)),
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 7, 0, BPF_JUMP_TO(10,RPTK), BPF_UDP(40)),
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 7, 0, BPF_JUMP_TO(11,RPTC), BPF_UDP(302)),
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 7, 0, BPF_JUMP_TO(12,PING), BPF_UDP(11)),
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 7, 0, BPF_JUMP_TO(13,RPTCL), BPF_UDP(9)),
+
+		EBPF(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, 0),			// DROP
+		EBPF(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		EBPF(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, -1),			// ACCEPT
+		EBPF(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+		EBPF(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, BPF_UDP(0)),		// RPTL
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, BPF_JUMP_TO(19,ACCEPT), BPF_TAG("RPTL")),
+		EBPF(BPF_JMP | BPF_JA, 0, 0, BPF_JUMP_TO(20,DROP), 0),
+		EBPF(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, BPF_UDP(0)),		// RPTK
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, BPF_JUMP_TO(22,ACCEPT), BPF_TAG("RPTK")),
+		EBPF(BPF_JMP | BPF_JA, 0, 0, BPF_JUMP_TO(23,DROP), 0),
+		EBPF(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, BPF_UDP(0)),		// RPTC
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, BPF_JUMP_TO(25,ACCEPT), BPF_TAG("RPTC")),
+		EBPF(BPF_JMP | BPF_JA, 0, 0, BPF_JUMP_TO(26,DROP), 0),
+		EBPF(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, BPF_UDP(0)),		// PING
+		EBPF(BPF_JMP | BPF_JNE | BPF_K, 0, 0, BPF_JUMP_TO(28,DROP), BPF_TAG("RPTP")),
+		EBPF(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, BPF_UDP(3)),
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, BPF_JUMP_TO(30,ACCEPT), BPF_TAG("PING")),
+		EBPF(BPF_JMP | BPF_JA, 0, 0, BPF_JUMP_TO(31,DROP), 0),
+		EBPF(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, BPF_UDP(0)),		// RPTCL
+		EBPF(BPF_JMP | BPF_JNE | BPF_K, 0, 0, BPF_JUMP_TO(33,DROP), BPF_TAG("RPTC")),
+		EBPF(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, BPF_UDP(4)),
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, BPF_JUMP_TO(35,ACCEPT), 'L'),
+		EBPF(BPF_JMP | BPF_JA, 0, 0, BPF_JUMP_TO(36,DROP), 0),
+
+		EBPF(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, BPF_UDP(0)),		// DMRD
+		EBPF(BPF_JMP | BPF_JNE | BPF_K, 0, 0, BPF_JUMP_TO(38,DROP), BPF_TAG("DMRD")),
+		EBPF(BPF_LD | BPF_ABS | BPF_W, 0, 0, 0, SKF_NET_OFF + 12),	// source address
+		EBPF(BPF_STX | BPF_MEM | BPF_W, 10, 0, -4, 0),
+		EBPF(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, g_auth_map),
+		EBPF(0, 0, 0, 0, 0),
+		EBPF(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+		EBPF(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4),
+		EBPF(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		EBPF(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, BPF_JUMP_TO(46,DROP), 0),
+		EBPF(BPF_JMP | BPF_JA, 0, 0, BPF_JUMP_TO(47,ACCEPT), 0),
+	};
+
+	memset (&attr, 0, sizeof(attr));
+
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (u64) (unsigned long) code;
+	attr.insn_cnt = sizeof(code) / sizeof(code[0]);
+	attr.license = (u64) (unsigned long) "GPL";
+
+	int fd = sys_bpf (BPF_PROG_LOAD, attr);
+
+	if (fd == -1) {
+
+		log (NULL, "Can't load socket filter (%d)\n", GetInetError());
+
+		close (g_auth_map);
+
+		g_auth_map = -1;
+
+		return false;
+	}
+
+	for (int i=0; i < g_shard_count; i++) {
+
+		if (setsockopt (g_shards[i].sock, SOL_SOCKET, SO_ATTACH_BPF, &fd, sizeof(fd)) == -1) {
+
+			log (NULL, "Can't attach socket filter (%d)\n", GetInetError());
+
+			for (int j=0; j < i; j++)
+				setsockopt (g_shards[j].sock, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+
+			close (fd);
+			close (g_auth_map);
+
+			g_auth_map = -1;
+
+			return false;
+		}
+	}
+
+	close (fd);		// the sockets hold on to it
+
+	return true;
+}
+#endif
+
+void attach_socket_filter ()
+{
+#ifdef HAVE_EBPF
+	if (g_socket_filter == SOCKET_FILTER_AUTH && attach_auth_filter ())
+		return;
+#endif
+
+	if (g_socket_filter == SOCKET_FILTER_AUTH) {
+
+		log (NULL, "Authenticated address filter not available, filtering packet shapes only\n");
+
+		g_socket_filter = SOCKET_FILTER_SHAPE;
+	}
+
+	if (!attach_shape_filter ())
+		g_socket_filter = SOCKET_FILTER_OFF;
+}
+
+// datagrams the kernel dropped on our sockets, filtered or overflowed
+
+dword socket_drops ()
+{
+	dword drops = 0;
+
+	for (int i=0; i < g_shard_count; i++) {
+
+		dword mem[SK_MEMINFO_VARS];
+
+		socklen_t len = sizeof(mem);
+
+		if (getsockopt (g_shards[i].sock, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0 && len > SK_MEMINFO_DROPS * sizeof(dword))
+			drops += mem[SK_MEMINFO_DROPS];
+	}
+
+	return drops;
+}
+#endif
+
+// the DMR ID part of a node ID, 0 if it's out of range
+
+dword node_dmrid (dword nodeid)
+{
+	dword dmrid = nodeid > 0xFFFFFF ? nodeid / 100 : nodeid;	// has ESSID?
+
+	return inrange(dmrid,LOW_DMRID,HIGH_DMRID) ? dmrid : 0;
+}
+
+void active_add (node *n)
+{
+	if (g_active_count == g_active_size) {
+
+		g_active_size = g_active_size ? g_active_size * 2 : 256;
+
+		node **p = new node*[g_active_size];
+
+		memcpy (p, g_active_nodes, g_active_count * sizeof(node*));
+
+		delete [] g_active_nodes;
+
+		g_active_nodes = p;
+	}
+
+	n->active_ix = g_active_count;
+
+	g_active_nodes[g_active_count++] = n;
+}
+
+void active_remove (node *n)
+{
+	node *last = g_active_nodes[--g_active_count];
+
+	g_active_nodes[n->active_ix] = last;
+
+	last->active_ix = n->active_ix;
+}
+
+// nodes are deleted NODE_TIMEOUT_SECS after they were last heard. hitsec is only
+// checked when the timer fires, so traffic doesn't have to touch the wheel
+
+int g_expired_nodes;		// since the last housekeeping report
+
+void delete_node (dword nodeid);
+
+void node_expiry_event (void *cookie)
+{
+	node *n = (node*) cookie;
+
+	dword idle = g_sec - n->hitsec;
+
+	if (idle >= NODE_TIMEOUT_SECS) {
+
+		g_expired_nodes ++;
+
+		delete_node (n->nodeid);
+	}
+
+	else {
+
+		timer_start (&n->expiry, (NODE_TIMEOUT_SECS - idle) * 1000, node_expiry_event, n);
+	}
+}
+
+node * findnode (dword nodeid, bool bCreateIfNecessary)
+{
+	nodeid = NODEID(nodeid);	// strip off possible slot bit
+
+	dword dmrid = node_dmrid (nodeid);
+
+	if (!dmrid) 
+		return NULL;
+
+	node **pn = g_nodes.find (nodeid);
+
+	if (pn)
+		return *pn;
+
+	if (!bCreateIfNecessary)
+		return NULL;
+
+	node *n = g_node_pool.alloc ();
+
+	if (!n)
+		return NULL;
+
+	n->nodeid = nodeid;
+	n->dmrid = dmrid;
+
+	n->slots[0].slotid = SLOTID(nodeid,0);
+	n->slots[1].slotid = SLOTID(nodeid,1);
+
+	n->hitsec = g_sec;
+
+	g_nodes.insert (nodeid) = n;
+
+	active_add (n);
+
+	timer_start (&n->expiry, NODE_TIMEOUT_SECS * 1000, node_expiry_event, n);
+
+	g_node_vectors.insert (dmrid).nodes ++;
+
+	return n;
+}
+
+void delete_node (dword nodeid)
+{
+	nodeid = NODEID(nodeid);	// strip off possible slot
+
+	node **pn = g_nodes.find (nodeid);
+
+	if (!pn)
+		return;
+
+	node *n = *pn;
+
+	log (&n->addr, "Delete node %d\n", nodeid);
+
+	if (n->bAuth)
+		auth_filter_remove (n->addr);
+
+	unsubscribe_from_group (&n->slots[0], true);
+
+	unsubscribe_from_group (&n->slots[1], true);
+
+	for (int i=0; i < 2; i++) {		// a recording that never got its end of stream
+
+		timer_stop (&n->slots[i].parrot_limit);
+
+		g_parrot_pool.free (n->slots[i].parrot);
+	}
+
+	timer_stop (&n->expiry);
+
+	g_stream_epoch ++;		// cached streams point at its slots
+
+	g_nodes.remove (nodeid);
+
+	active_remove (n);
+
+	nodevector *v = g_node_vectors.find (n->dmrid);
+
+	if (v && --v->nodes <= 0)
+		g_node_vectors.remove (n->dmrid);
+
+	g_node_pool.free (n);
+}
+
+slot * findslot (int slotid, bool bCreateIfNecessary)
+{
+	node *n = findnode (NODEID(slotid), bCreateIfNecessary);
+
+	if (!n)
+		return NULL;
+
+	return &n->slots[SLOT(slotid)];
+}
+
+// Radio locations. Every radio heard is kept with the slots it was heard on, so a private
+// call to any radio is one lookup. A roaming radio is remembered on up to RADIO_LOCATIONS
+// nodes and calls go to each of them heard within g_radio_ttl, the oldest node gives way
+// to a new one. Hearing it on the other slot of a node it's on just moves it.
+
+void radio_heard (dword radioid, dword slotid)
+{
+	if (!radioid)		// the map's empty key
+		return;
+
+	radio_loc &r = g_radios.insert (radioid);
+
+	int i, oldest = 0;
+
+	for (i=0; i < RADIO_LOCATIONS && r.slotid[i] && NODEID(r.slotid[i]) != NODEID(slotid); i++) {
+
+		if (r.sec[i] < r.sec[oldest])
+			oldest = i;
+	}
+
+	if (i == RADIO_LOCATIONS)
+		i = oldest;
+
+	r.slotid[i] = slotid;
+	r.sec[i] = g_sec;
+}
+
+// drop locations past g_radio_ttl or on deleted nodes, and radios left with none. Returns
+// how many radios were dropped
+
+int radios_expire ()
+{
+	int dropped = 0;
+
+	for (int i=0; i < g_radios.capacity (); ) {
+
+		if (!g_radios.key (i)) {
+
+			i ++;
+			continue;
+		}
+
+		radio_loc &r = g_radios.value (i);
+
+		int j, kept = 0;
+
+		for (j=0; j < RADIO_LOCATIONS && r.slotid[j]; j++) {
+
+			if (g_sec - r.sec[j] < (dword) g_radio_ttl && findnode (NODEID(r.slotid[j]), false)) {
+
+				r.slotid[kept] = r.slotid[j];
+				r.sec[kept] = r.sec[j];
+				kept ++;
+			}
+		}
+
+		for (j=kept; j < RADIO_LOCATIONS; j++)
+			r.slotid[j] = r.sec[j] = 0;
+
+		if (kept)
+			i ++;
+
+		else {
+
+			g_radios.remove (g_radios.key (i));		// may move another entry into i
+
+			dropped ++;
+		}
+	}
+
+	return dropped;
+}
+
+// the scanners that follow g, from their [scanner N] sections
+
+void scanners_for (talkgroup *g)
+{
+	delete [] g->scanners;
+
+	g->scanners = NULL;
+	g->nscanners = 0;
+
+	if (g->bScanner)
+		return;
+
+	for (int i=0; i < g_scanner_count; i++) {
+
+		scanner_def const &d = g_scanner_defs[i];
+
+		if (!d.g || !d.groups.test (g->tg))
+			continue;
+
+		if (!g->scanners)
+			g->scanners = new scanner_ref[g_scanner_count];
+
+		int prio = 0;
+
+		while (prio < d.npriority && d.priority[prio] != g->tg)
+			prio ++;
+
+		g->scanners[g->nscanners].sc = d.g;
+		g->scanners[g->nscanners].prio = prio;
+		g->nscanners ++;
+	}
+}
+
+talkgroup * findgroup (dword tg, bool bCreateIfNecessary)
+{
+	talkgroup **pg = g_talkgroups.find (tg);
+
+	if (pg)
+		return *pg;
+
+	if (!bCreateIfNecessary || !inrange(tg,1,HIGH_TG) || g_talkgroups.size () >= MAX_GROUPS)
+		return NULL;
+
+	talkgroup *g = g_talkgroup_pool.alloc ();
+
+	if (!g)
+		return NULL;
+
+	g->tg = tg;
+
+	g_talkgroups.insert (tg) = g;
+
+	scanners_for (g);
+
+	return g;
+}
+
+// true if a keyup may make group tg
+
+bool tg_allowed (dword tg)
+{
+	for (int i=0; i < g_tg_range_count; i++) {
+
+		if (inrange(tg, g_tg_ranges[i].low, g_tg_ranges[i].high))
+			return true;
+	}
+
+	return false;
+}
+
+// parse ranges like "1-9999, 91, 310000-319999", returns how many went in r
+
+int parse_ranges (PCSTR p, tg_range *r, int max)
+{
+	int count = 0;
+
+	while (*p && count < max) {
+
+		char *end;
+
+		dword low = strtoul (p, &end, 10);
+
+		if (end == p) {		// separator
+
+			p ++;
+			continue;
+		}
+
+		dword high = low;
+
+		p = skipspaces (end);
+
+		if (*p == '-') {
+
+			high = strtoul (p+1, &end, 10);
+			p = end;
+		}
+
+		if (low < 1)
+			low = 1;
+
+		if (high > HIGH_TG)
+			high = HIGH_TG;
+
+		if (low <= high) {
+
+			r[count].low = low;
+			r[count].high = high;
+			count ++;
+		}
+	}
+
+	return count;
+}
+
+void _dump_groups(std::string &ret)
+{
+	char temp[200];
+
+	for (int i=0; i < g_talkgroups.capacity (); i++) {
+
+		if (!g_talkgroups.key (i))
+			continue;
+
+		talkgroup const *g = g_talkgroups.value (i);
+
+		sprintf (temp, "TALKGROUP %d owner %d slot %d head %p %d\n", g->tg, NODEID(g->floor->ownerslot), SLOT(g->floor->ownerslot)+1, g->subscribers, g->subscribers ? g->subscribers->s->node->nodeid : 0);
+
+		ret += temp;
+
+		subscription *sub = g->subscribers;
+
+		while (sub) {
+
+			sprintf (temp, "\t%p node %d slot %d prev %p next %p\n", sub, sub->s->node->nodeid, SLOT(sub->s->slotid)+1, sub->prev, sub->next);
+
+			ret += temp;
+
+			sub = sub->next;
+		}
+	}
+}
+
+void dump_groups()
+{
+	if (g_debug) {
+
+		std::string str;
+
+		puts (str.c_str());
+	}
+}
+
+// control plane queues, see handle_control()
+
+struct ctl_packet
+{
+	sockaddr_in		addr;
+	int				size;
+	byte			buf[CTL_PACKET_SIZE];
+};
+
+spsc_ring<ctl_packet> *g_ctlq;		// from each shard, indexed by shard
+semaphore g_ctl_sem;				// posted for each queued packet
+shard g_control;					// the control thread's shard, for sendpacket()
+dword g_ctl_packets;				// handled by the control thread
+dword volatile g_ctl_dropped;		// control queue full, counted by every shard
+dword g_dmrd_rejected;				// DMRD from unknown or unauthenticated nodes
+
+#ifdef LINUX
+
+void add_stage (stage_stats &to, stage_stats const &from)
+{
+	to.items += from.items;
+	to.latency += from.latency;
+
+	if (from.peak > to.peak)
+		to.peak = from.peak;
+
+	if (from.maxlatency > to.maxlatency)
+		to.maxlatency = from.maxlatency;
+}
+
+#endif
+
+void add_pool (std::string &ret, slab_stats &total, PCSTR name, slab_stats const &st)
+{
+	char temp[100];
+
+	sprintf (temp, " %s %u/%u/%u", name, st.used, st.peak, st.capacity);
+
+	ret += temp;
+
+	total.slabs += st.slabs;
+	total.huge += st.huge;
+	total.failed += st.failed;
+}
+
+// packet buffers summed over the shards, free is what the owners have on hand
+
+void add_packet_buffers (std::string &ret)
+{
+	static PCSTR const names[] = {"rx", "xshard", "pipe", "uring", "fanout", "parrot"};
+
+	char temp[100];
+
+	int nfree = 0, low = 0, i, c;
+	dword allocs = 0, failed = 0;
+
+	for (i=0; i < g_shard_count; i++) {
+
+		pkt_stats const &st = g_shards[i].pkts.stats();
+
+		nfree += g_shards[i].pkts.free_count ();
+		low += st.low;
+		allocs += st.allocs;
+		failed += st.failed;
+	}
+
+	sprintf (temp, "Packet buffers %d per shard, free %d low %d allocs %u failed %u, held/refused/released", g_packet_buffers, nfree, low, allocs, failed);
+
+	ret += temp;
+
+	for (c=0; c < (int) (sizeof(names) / sizeof(names[0])); c++) {
+
+		dword holds = 0, refused = 0, releases = 0;
+
+		for (i=0; i < g_shard_count; i++) {
+
+			pkt_stats const &st = g_shards[i].pkts.stats();
+
+			holds += st.holds[c];
+			refused += st.refused[c];
+			releases += st.releases[c];
+		}
+
+		sprintf (temp, " %s %u/%u/%u", names[c], holds, refused, releases);
+
+		ret += temp;
+	}
+
+	ret += "\n";
+}
+
+// keep index i in a list of the STAT_WORST highest scores so far, highest first.
+// Returns the new length
+
+int stat_worst (int *index, u64 *score, int count, int i, u64 s)
+{
+	int j = count < STAT_WORST ? count++ : STAT_WORST;
+
+	for (; j > 0 && score[j-1] < s; j--) {
+
+		if (j < STAT_WORST) {
+
+			index[j] = index[j-1];
+			score[j] = score[j-1];
+		}
+	}
+
+	if (j < STAT_WORST) {
+
+		index[j] = i;
+		score[j] = s;
+	}
+
+	return count;
+}
+
+void _dump_stats(std::string &ret)
+{
+	char temp[300];
+
+	rx_stats rx;	// all shards
+	tx_stats tx;
+
+	int i, j, k;
+
+#ifdef LINUX
+	stage_stats rxstage, txstage;	// pipeline queues, all shards
+
+	dword rx_full = 0;
+#endif
+
+	for (i=0; i < g_shard_count; i++) {
+
+		rx_stats const &r = g_shards[i].rxstats;
+		tx_stats const &t = g_shards[i].txstats;
+
+		rx.calls += r.calls;
+		rx.packets += r.packets;
+		rx.full += r.full;
+		rx.errors += r.errors;
+		rx.junk += r.junk;
+
+		if (r.peak > rx.peak)
+			rx.peak = r.peak;
+
+		tx.calls += t.calls;
+		tx.packets += t.packets;
+		tx.errors += t.errors;
+		tx.forwarded += t.forwarded;
+		tx.ring_full += t.ring_full;
+
+		for (j=0; j < TX_HISTOGRAM; j++)
+			tx.hist[j] += t.hist[j];
+
+#ifdef LINUX
+		if (g_shards[i].txp) {
+
+			shard const &sh = g_shards[i];
+
+			rx_full += sh.rx_full;
+
+			add_stage (rxstage, sh.rxstage);
+
+			for (j=0; j < g_tx_threads; j++) {
+
+				tx_pipe const &tp = sh.txp[j];
+
+				add_stage (txstage, tp.stage);
+
+				tx.calls += tp.stats.calls;
+				tx.errors += tp.stats.errors;
+
+				for (k=0; k < TX_HISTOGRAM; k++)
+					tx.hist[k] += tp.stats.hist[k];
+			}
+		}
+#endif
+	}
+
+	rx.batch = g_shards[0].rxstats.batch;
+
+#ifdef HAVE_IO_URING
+	ret += g_shards[0].bUring ? "IO io_uring\n" : "IO socket\n";
+#else
+	ret += "IO socket\n";
+#endif
+
+	sprintf (temp, "RX batch %d/%d calls %u packets %u (%.2f per call) full %u peak %d errors %u junk %u\n",
+		rx.batch, g_rx_batch, rx.calls, rx.packets,
+		rx.calls ? (double) rx.packets / rx.calls : 0.0,
+		rx.full, rx.peak, rx.errors, rx.junk);
+
+	ret += temp;
+
+	sprintf (temp, "TX batch %d calls %u packets %u errors %u sizes", g_tx_batch, tx.calls, tx.packets, tx.errors);
+
+	ret += temp;
+
+	for (i=0; i < TX_HISTOGRAM; i++) {
+
+		sprintf (temp, " %d:%u", 1 << i, tx.hist[i]);
+
+		ret += temp;
+	}
+
+	ret += "\n";
+
+	if (g_shard_count > 1) {
+
+		sprintf (temp, "Shards %d forwarded %u queue full %u, rx/tx", g_shard_count, tx.forwarded, tx.ring_full);
+
+		ret += temp;
+
+		for (i=0; i < g_shard_count; i++) {
+
+			sprintf (temp, " %u/%u", g_shards[i].rxstats.packets, g_shards[i].txstats.packets);
+
+			ret += temp;
+		}
+
+		ret += "\n";
+	}
+
+#ifdef LINUX
+	if (g_shards[0].txp) {
+
+		sprintf (temp, "Pipeline tx threads %d, rx->route %u peak %u avg %u max %u us wait %u, route->tx %u peak %u avg %u max %u us\n",
+			g_tx_threads,
+			rxstage.items, rxstage.peak, rxstage.items ? (dword) (rxstage.latency / rxstage.items) : 0, rxstage.maxlatency, rx_full,
+			txstage.items, txstage.peak, txstage.items ? (dword) (txstage.latency / txstage.items) : 0, txstage.maxlatency);
+
+		ret += temp;
+	}
+#endif
+
+#ifdef LINUX
+	if (g_busy_poll) {
+
+		u64 loops = 0, idle = 0;
+
+		for (i=0; i < g_shard_count; i++) {
+
+			loops += g_shards[i].loops;
+			idle += g_shards[i].idle;
+		}
+
+		sprintf (temp, "Busy poll %dus cpu %d loops %llu idle %llu (%.1f%% idle)\n", g_busy_poll_us, g_cpu, loops, idle, loops ? 100.0 * idle / loops : 0.0);
+
+		ret += temp;
+	}
+#endif
+
+	sprintf (temp, "Control packets %u dropped %u, DMRD rejected %u\n", g_ctl_packets, g_ctl_dropped, g_dmrd_rejected);
+
+	ret += temp;
+
+	sprintf (temp, "Talkgroups %d made %u freed %u, idle %d min\n", g_talkgroups.size (), g_groups_made, g_groups_freed, g_group_idle_minutes);
+
+	ret += temp;
+
+	for (i=0; i < g_bridge_count; i++) {
+
+		talkgroup *g = findgroup (g_bridges[i].tg[0], false);
+
+		if (!g || !g->link)
+			continue;
+
+		sprintf (temp, "Bridge %s", g_bridges[i].name.c_str());
+		ret += temp;
+
+		talkgroup *m = g->floor;
+
+		do {
+			sprintf (temp, " %u/%d", m->tg, m->count);
+			ret += temp;
+
+			m = m->link;
+
+		} while (m != g->floor);
+
+		sprintf (temp, ", owner %s on %u, listeners %d\n", g->floor->ownerslot ? slotid_str(g->floor->ownerslot).c_str() : "none", g->floor->ownerslot ? g->floor->keyed->tg : 0, fanout_plan (g)->count);
+		ret += temp;
+	}
+
+	for (i=0; i < g_scanner_count; i++) {
+
+		talkgroup const *sc = g_scanner_defs[i].g;
+
+		sprintf (temp, "Scanner %u listeners %d priority groups %d bitmap pages %d, owner %s priority %d\n", sc->tg, sc->count, g_scanner_defs[i].npriority, g_scanner_defs[i].groups.pages (), sc->ownerslot ? slotid_str(sc->ownerslot).c_str() : "none", sc->scanprio);
+		ret += temp;
+	}
+
+	sprintf (temp, "Subscriptions %d static %d, timeout %d min expired %u\n", g_subscription_pool.stats().used, g_static_subs, g_subscription_minutes, g_subscriptions_expired);
+
+	ret += temp;
+
+	sprintf (temp, "Radios heard %d ttl %d secs, private call frames %u not routed %u\n", g_radios.size (), g_radio_ttl, g_private_frames, g_private_unrouted);
+
+	ret += temp;
+
+	sprintf (temp, "Streams cached %d hits %u misses %u epoch %u\n", g_streams.size (), g_stream_hits, g_stream_misses, g_stream_epoch);
+
+	ret += temp;
+
+	int worst[STAT_WORST], shown = 0;
+	u64 score[STAT_WORST];
+
+	for (i=0; i < g_streams.capacity (); i++) {		// the live ones losing most, then the most jittery
+
+		stream_entry const &e = g_streams.value (i);
+
+		if (g_streams.key (i) && e.epoch == g_stream_epoch)
+			shown = stat_worst (worst, score, shown, i, ((u64) e.lost << 32) | (e.jitter >> 4));
+	}
+
+	for (k=0; k < shown; k++) {
+
+		stream_entry const &e = g_streams.value (worst[k]);
+
+		sprintf (temp, "\tStream %08X node %u TG %u frames %u lost %u jitter %.1f ms\n", g_streams.key (worst[k]), e.s->node->nodeid, e.g->tg, e.frames, e.lost, (e.jitter >> 4) / 1000.0);
+
+		ret += temp;
+	}
+
+	shown = 0;
+
+	for (i=0; i < g_talkgroups.capacity (); i++) {		// and the same for groups that have had streams
+
+		talkgroup const *g = g_talkgroups.key (i) ? g_talkgroups.value (i) : NULL;
+
+		if (g && g->qos.streams)
+			shown = stat_worst (worst, score, shown, i, ((u64) g->qos.lost << 32) | g->qos.maxjitter);
+	}
+
+	for (k=0; k < shown; k++) {
+
+		talkgroup const *g = g_talkgroups.value (worst[k]);
+
+		sprintf (temp, "%s TG %u %u/%u/%u %.1f/%.1f", k ? "," : "QoS streams/frames/lost jitter last/worst ms,", g->tg, g->qos.streams, g->qos.frames, g->qos.lost, g->qos.jitter / 1000.0, g->qos.maxjitter / 1000.0);
+
+		ret += temp;
+	}
+
+	if (shown)
+		ret += "\n";
+
+	if (g_seq_filter) {
+
+		sprintf (temp, "Sequence filter %s seq_late %d, dropped duplicates %u late %u", g_seq_filter == SEQ_FILTER_LATE ? "late" : "dup", g_seq_late, g_seq_dropped_dups, g_seq_dropped_late);
+
+		ret += temp;
+
+		shown = 0;
+
+		for (i=0; i < g_talkgroups.capacity (); i++) {		// the groups that dropped most
+
+			talkgroup const *g = g_talkgroups.key (i) ? g_talkgroups.value (i) : NULL;
+
+			if (g && (g->seq_dups || g->seq_late))
+				shown = stat_worst (worst, score, shown, i, (u64) g->seq_dups + g->seq_late);
+		}
+
+		for (k=0; k < shown; k++) {
+
+			talkgroup const *g = g_talkgroups.value (worst[k]);
+
+			sprintf (temp, "%s TG %u %u/%u", k ? "," : ", dup/late", g->tg, g->seq_dups, g->seq_late);
+
+			ret += temp;
+		}
+
+		ret += "\n";
+	}
+
+	slab_stats pools;
+
+	ret += "Pools used/peak/capacity";
+
+	add_pool (ret, pools, "node", g_node_pool.stats());
+	add_pool (ret, pools, "talkgroup", g_talkgroup_pool.stats());
+	add_pool (ret, pools, "subscription", g_subscription_pool.stats());
+	add_pool (ret, pools, "parrot", g_parrot_pool.stats());
+	add_pool (ret, pools, "fanout", g_fanout_job_pool.stats());
+	add_pool (ret, pools, "plan", g_plan_stats);
+
+	sprintf (temp, ", slabs %u huge %u failed %u\n", pools.slabs, pools.huge, pools.failed);
+
+	ret += temp;
+
+	add_packet_buffers (ret);
+
+#ifdef LINUX
+	if (g_socket_filter) {
+
+		sprintf (temp, "Socket filter %s, authenticated addresses %d, kernel drops %u\n", g_socket_filter == SOCKET_FILTER_AUTH ? "auth" : "shape", (int) g_auth_addrs.size(), socket_drops ());
+
+		ret += temp;
+	}
+#endif
+
+	if (g_fanout_threads) {
+
+		sprintf (temp, "Fanout threads %d threshold %d jobs %u busy %u, chunks/packets/errors", g_fanout_threads, g_fanout_threshold, g_fanout_jobs, g_fanout_busy);
+
+		ret += temp;
+
+		for (i=0; i < g_fanout_threads; i++) {
+
+			sprintf (temp, " %u/%u/%u", g_fanout_workers[i].chunks, g_fanout_workers[i].packets, g_fanout_workers[i].errors);
+
+			ret += temp;
+		}
+
+		ret += "\n";
+	}
+}
+
+// what /STAT shows of a node, copied under g_state_lock and printed after
+
+struct node_status
+{
+	dword			nodeid;
+	dword			dmrid;
+	sockaddr_in		addr;
+	bool			bAuth;
+	dword			hitsec;
+	int				vector;				// nodes with its dmrid
+	qos_stats		qos;
+	dword			seq_dups;
+	dword			seq_late;
+	int				ntg[2];
+	dword			tg[2][MAX_SLOT_GROUPS];		// static ones with STATUS_STATIC set
+};
+
+#define STATUS_STATIC 0x80000000
+
+struct node_key
+{
+	dword			dmrid;
+	dword			nodeid;
+};
+
+int compare_nodes (void const *a, void const *b)
+{
+	node_key const *x = (node_key const *) a;
+	node_key const *y = (node_key const *) b;
+
+	if (x->dmrid != y->dmrid)
+		return x->dmrid < y->dmrid ? -1 : 1;
+
+	return x->nodeid < y->nodeid ? -1 : x->nodeid > y->nodeid;
+}
+
+// The node list. Takes g_state_lock itself, twice and briefly: once to copy every
+// node's dmrid and ID, which are sorted outside it, and once to copy the first
+// MAX_STATUS_NODES of them, which are printed outside it
+
+void _dump_nodes(std::string &ret)
+{
+	char temp[200];
+
+	sprintf (temp, "Sec %d tick %u\n", g_sec, g_tick);
+
+	ret += temp;
+
+	g_state_lock.lock ();
+
+	int count = g_active_count, i, j, k;
+
+	node_key *keys = new node_key[count + 1];
+
+	for (i=0; i < count; i++) {
+
+		keys[i].dmrid = g_active_nodes[i]->dmrid;
+		keys[i].nodeid = g_active_nodes[i]->nodeid;
+	}
+
+	g_state_lock.unlock ();
+
+	qsort (keys, count, sizeof(node_key), compare_nodes);		// grouped by dmrid
+
+	int shown = count < MAX_STATUS_NODES ? count : MAX_STATUS_NODES, found = 0;
+
+	node_status *st = new node_status[shown + 1];
+
+	g_state_lock.lock ();
+
+	for (i=0; i < shown; i++) {
+
+		node **pn = g_nodes.find (keys[i].nodeid);
+
+		if (!pn)
+			continue;		// gone since
+
+		node const *n = *pn;
+		node_status &s = st[found++];
+
+		nodevector const *v = g_node_vectors.find (n->dmrid);
+
+		s.nodeid = n->nodeid;
+		s.dmrid = n->dmrid;
+		s.addr = n->addr;
+		s.bAuth = n->bAuth;
+		s.hitsec = n->hitsec;
+		s.vector = v ? v->nodes : 0;
+		s.qos = n->qos;
+		s.seq_dups = n->seq_dups;
+		s.seq_late = n->seq_late;
+
+		for (j=0; j < 2; j++) {
+
+			s.ntg[j] = 0;
+
+			for (subscription const *sub = n->slots[j].subs; sub && s.ntg[j] < MAX_SLOT_GROUPS; sub = sub->snext)
+				s.tg[j][s.ntg[j]++] = sub->g->tg | (sub->bStatic ? STATUS_STATIC : 0);
+		}
+	}
+
+	g_state_lock.unlock ();
+
+	for (i=0; i < found; i++) {
+
+		node_status const &s = st[i];
+
+		if (!i || st[i-1].dmrid != s.dmrid) {
+
+			sprintf (temp, "Node vector %d, nodes %d\n", s.dmrid, s.vector);
+
+			ret += temp;
+		}
+
+		sprintf (temp, "\t%s ID %d dmrid %d auth %d sec %u\n", my_inet_ntoa(s.addr.sin_addr).c_str(), s.nodeid, s.dmrid, s.bAuth, s.hitsec);
+
+		ret += temp;
+
+		if (s.qos.streams) {
+
+			sprintf (temp, "\t\tQoS streams %u frames %u lost %u jitter %.1f/%.1f ms\n", s.qos.streams, s.qos.frames, s.qos.lost, s.qos.jitter / 1000.0, s.qos.maxjitter / 1000.0);
+			ret += temp;
+		}
+
+		if (s.seq_dups || s.seq_late) {
+
+			sprintf (temp, "\t\tSequence dup %u late %u\n", s.seq_dups, s.seq_late);
+			ret += temp;
+		}
+
+		for (j=0; j < 2; j++) {
+
+			if (s.ntg[j]) {
+
+				sprintf (temp, "\t\tS%d TG", j+1);
+				ret += temp;
+
+				for (k=0; k < s.ntg[j]; k++) {
+
+					sprintf (temp, " %u%s", s.tg[j][k] & ~STATUS_STATIC, (s.tg[j][k] & STATUS_STATIC) ? "s" : "");
+					ret += temp;
+				}
+
+				ret += "\n";
+			}
+		}
+	}
+
+	if (count > shown) {
+
+		sprintf (temp, "and %d more nodes\n", count - shown);
+
+		ret += temp;
+	}
+
+	delete [] st;
+	delete [] keys;
+}
+
+void dump_nodes()
+{
+	if (g_debug) {
+
+		std::string str;
+
+		puts (str.c_str());
+	}
+}
+
+// group owner timeouts. Taking a group (the scanner included) starts its owner timer,
+// and each frame from the owner only updates g->tick, which the timer checks when it
+// fires and starts itself again for the rest of the time if the owner is still talking.
+// A bridge's owner, tick and timer are on its floor
+
+void owner_timeout_event (void *cookie)
+{
+	talkgroup *g = (talkgroup*) cookie;
+
+	if (!g->ownerslot)
+		return;
+
+	dword elapsed = g_tick - g->tick;
+
+	if (elapsed >= OWNER_TIMEOUT_MS) {
+
+		log (NULL, "Timeout %s %u, slotid %s", g->bScanner ? "scanner" : "group", g->keyed->tg, slotid_str(g->ownerslot).c_str());
+
+		g->ownerslot = 0;
+
+		g_stream_epoch ++;
+	}
+
+	else {
+
+		timer_start (&g->owner_timer, OWNER_TIMEOUT_MS - elapsed, owner_timeout_event, g);
+	}
+}
+
+void take_group (talkgroup *g, dword slotid)
+{
+	talkgroup *f = g->floor;
+
+	f->ownerslot = slotid;
+	f->keyed = g;
+
+	g_stream_epoch ++;
+
+	f->tick = g_tick;
+
+	timer_start (&f->owner_timer, OWNER_TIMEOUT_MS, owner_timeout_event, f);
+}
+
+void release_group (talkgroup *g)
+{
+	g = g->floor;
+
+	g->ownerslot = 0;
+
+	g_stream_epoch ++;
+
+	timer_stop (&g->owner_timer);
+
+	fanout_list const *l = fanout_plan (g);
+
+	for (int i=0; l->nshared && i < l->count; i++) {		// its shared slots are free for another stream
+
+		slot *s = l->dest[i].shared;
+
+		if (s && s->rxfloor == g)
+			s->rxfloor = NULL;
+	}
+}
+
+// a made group's last subscriber left g_group_idle_minutes ago. One that has been joined
+// since is left alone, its timer starts again when it empties
+
+void group_idle_event (void *cookie)
+{
+	talkgroup *g = (talkgroup*) cookie;
+
+	if (g->count || g->ownerslot || g->bKeep)
+		return;
+
+	log (NULL, "Free idle group %u\n", g->tg);
+
+	timer_stop (&g->owner_timer);
+
+	fanout_rebuild (g);
+
+	g_stream_epoch ++;		// stale cached streams may still point at it
+
+	g_talkgroups.remove (g->tg);
+
+	g_talkgroup_pool.free (g);
+
+	g_groups_freed ++;
+}
+
+// take a subscription out of its group and its slot's list, *pp is the link to it
+
+void unsubscribe_link (subscription **pp)
+{
+	subscription *sub = *pp;
+
+	slot *s = sub->s;
+	talkgroup *g = sub->g;
+
+	log (&s->node->addr, "Unsubscribe node %d slot %d from talkgroup %d\n", s->node->nodeid, SLOT(s->slotid)+1, g->tg);
+
+	if (g->floor->ownerslot == s->slotid && g->floor->keyed == g)		// if owner, release ownership
+		release_group (g);
+
+	if (sub->prev)
+		sub->prev->next = sub->next;
+
+	else
+		g->subscribers = sub->next;
+
+	if (sub->next)
+		sub->next->prev = sub->prev;
+
+	if (--g->count == 0 && !g->bKeep && g_group_idle_minutes)
+		timer_start (&g->idle_timer, g_group_idle_minutes * 60000, group_idle_event, g);
+
+	*pp = sub->snext;
+
+	if (--s->groups == 1)
+		fanout_rebuild (s->subs->g);		// its last group, where it isn't shared any more
+
+	if (sub->bStatic) {
+
+		s->statics --;
+		g_static_subs --;
+	}
+
+	timer_stop (&sub->timer);
+
+	fanout_rebuild (g);
+
+	g_stream_epoch ++;
+
+	g_subscription_pool.free (sub);
+}
+
+// leave every group, the static ones as well only when the node is going
+
+void unsubscribe_from_group(slot *s, bool bStatic)
+{
+	bool bLeft = false;
+
+	for (subscription **pp = &s->subs; *pp; ) {
+
+		if (bStatic || !(*pp)->bStatic) {
+
+			unsubscribe_link (pp);
+
+			bLeft = true;
+		}
+
+		else
+			pp = &(*pp)->snext;
+	}
+
+	if (bLeft)
+		dump_groups ();
+}
+
+// a dynamic subscription's timer. A keyup on the group only updates sub->sec, the timer
+// starts itself again for the rest of the time, like the owner timers
+
+void subscription_timeout_event (void *cookie)
+{
+	subscription *sub = (subscription*) cookie;
+
+	dword const limit = g_subscription_minutes * 60;
+	dword const idle = g_sec - sub->sec;
+
+	if (idle < limit) {
+
+		timer_start (&sub->timer, (limit - idle) * 1000, subscription_timeout_event, sub);
+		return;
+	}
+
+	log (&sub->s->node->addr, "Subscription timeout node %d slot %d talkgroup %d, idle %u secs\n", sub->s->node->nodeid, SLOT(sub->s->slotid)+1, sub->g->tg, idle);
+
+	g_subscriptions_expired ++;
+
+	for (subscription **pp = &sub->s->subs; *pp; pp = &(*pp)->snext) {
+
+		if (*pp == sub) {
+
+			unsubscribe_link (pp);
+			break;
+		}
+	}
+
+	dump_groups ();
+}
+
+// join a group, keeping the others. A scanner is a slot's only dynamic group. When the
+// slot already has g_slot_groups dynamic ones, the one keyed longest ago is left. A
+// static subscription replaces a dynamic one to the same group
+
+void subscribe_to_group(slot *s, talkgroup *g, bool bStatic=false)
+{
+	subscription **pp = &s->subs;
+
+	bool bScanner = false;
+
+	for (; *pp; pp = &(*pp)->snext) {
+
+		subscription *sub = *pp;
+
+		if (sub->g == g) {
+
+			sub->sec = g_sec;
+
+			if (bStatic && !sub->bStatic) {
+
+				timer_stop (&sub->timer);
+
+				sub->bStatic = true;
+				s->statics ++;
+				g_static_subs ++;
+			}
+
+			if (pp != &s->subs) {		// most recently keyed to the front
+
+				*pp = sub->snext;
+				sub->snext = s->subs;
+				s->subs = sub;
+			}
+
+			return;
+		}
+
+		if (sub->g->bScanner)
+			bScanner = true;
+	}
+
+	if (!bStatic) {
+
+		if (g->bScanner || bScanner)
+			unsubscribe_from_group (s);
+
+		while (s->groups - s->statics >= g_slot_groups) {	// leave the dynamic one keyed longest ago
+
+			subscription **last = NULL;
+
+			for (pp = &s->subs; *pp; pp = &(*pp)->snext) {
+
+				if (!(*pp)->bStatic)
+					last = pp;
+			}
+
+			unsubscribe_link (last);
+		}
+	}
+
+	subscription *sub = g_subscription_pool.alloc ();
+
+	if (!sub)
+		return;
+
+	log (&s->node->addr, "Subscribe node %d slot %d to talkgroup %d%s\n", s->node->nodeid, SLOT(s->slotid)+1, g->tg, bStatic ? " static" : "");
+
+	// insert at head of subscriber list for this group
+
+	sub->s = s;
+	sub->g = g;
+	sub->prev = NULL;
+	sub->next = g->subscribers;
+
+	if (sub->next)
+		sub->next->prev = sub;
+
+	g->subscribers = sub;
+
+	g->count ++;
+
+	sub->snext = s->subs;
+	s->subs = sub;
+
+	if (++s->groups == 2)
+		fanout_rebuild (sub->snext->g);		// where it was alone, it's shared now
+
+	sub->bStatic = bStatic;
+	sub->sec = g_sec;
+
+	if (bStatic) {
+
+		s->statics ++;
+		g_static_subs ++;
+	}
+
+	else if (g_subscription_minutes)
+		timer_start (&sub->timer, g_subscription_minutes * 60000, subscription_timeout_event, sub);
+
+	fanout_rebuild (g);
+
+	g_stream_epoch ++;
+
+	dump_groups ();
+}
+
+// a node that has just logged in joins its slots' [static] groups
+
+void subscribe_static (node *n)
+{
+	for (int i=0; i < 2; i++) {
+
+		static_groups const *sg = g_static_groups.find (n->slots[i].slotid);
+
+		for (int j=0; sg && j < sg->count; j++) {
+
+			talkgroup *g = findgroup (sg->tg[j], false);
+
+			if (g)
+				subscribe_to_group (&n->slots[i], g, true);
+		}
+	}
+}
+
+int streams_expire ();
+
+void do_housekeeping()
+{
+	dword t = g_sec;
+
+	dword starttick = g_tick;
+
+	log (NULL, "Housekeeping, tick %u\n", starttick);
+
+	// inactive nodes are deleted by their expiry timers, see node_expiry_event()
+
+	int active = g_active_count, dropped_nodes = g_expired_nodes, radios = 0, dropped_radios = 0;
+
+	g_expired_nodes = 0;
+
+	int dropped_streams = streams_expire ();
+
+	dropped_radios = radios_expire ();
+
+	radios = g_radios.size ();
+	
+	log (NULL, "Done - %u secs, %u active nodes, %u dropped nodes, %d radios, %d dropped radios, %d dropped streams, %u ticks\n", g_sec, active, dropped_nodes, radios, dropped_radios, dropped_streams, g_tick - starttick);
+}
+
+void swapbytes (byte *a, byte *b, int sz)
+{
+	while (sz--) 
+		swap (*a++, *b++);
+}
+
+// Time thread. We don't use time() or any other time function in the C/C++ library for the "DMRD" packets
+// because they are expensive, and we want the highest performance.
+// This counter does not need to be perfectly accurate.
+
+PTHREAD_PROC(time_thread_proc) 
+{
+	for (;;) {
+
+		Sleep (50);
+
+		g_tick += 50;
+
+		if (!(g_tick % 1000))
+			g_sec ++;
+	}
+
+	return 0;
+}
+
+// parrot playback. Each recording has its own timer that sends one frame every
+// PARROT_FRAME_MS, after a delay of PARROT_DELAY_MS
+
+void parrot_frame_event (void *cookie)
+{
+	parrot_rec *r = (parrot_rec*) cookie;
+
+	if (r->played < r->frames) {
+
+		pkt_buf *pb = r->frame[r->played++];
+
+		sendpacket (r->addr, pb->data, pb->size);
+
+		pkt_pool::release (pb, PKT_PARROT);
+
+		timer_repeat (&r->timer, PARROT_FRAME_MS);
+	}
+
+	else {		// done
+
+		g_parrot_pool.free (r);
+	}
+}
+
+void start_parrot_playback (parrot_rec *r)
+{
+	r->played = 0;
+
+	timer_start (&r->timer, PARROT_DELAY_MS, parrot_frame_event, r);
+}
+
+// keep a reference to the received frame. The end of stream frame always has room,
+// a frame is dropped if the packet buffers are running out
+
+void parrot_record (parrot_rec *r, pkt_buf *pb, bool bEnd)
+{
+	if (r->frames < PARROT_FRAMES - (bEnd ? 0 : 1) && g_shard->pkts.hold (pb, PKT_PARROT))
+		r->frame[r->frames++] = pb;
+}
+
+void parrot_limit_event (void *cookie)
+{
+	slot *s = (slot*) cookie;
+
+	log (&s->node->addr, "Parrot recording limit on slotid %s\n", slotid_str(s->slotid).c_str());
+
+	s->bParrotFull = true;
+}
+
+// a voice frame of a cached stream, the part of handle_rx() that's left
+
+void stream_relay (stream_entry *e, pkt_buf *pb)
+{
+	talkgroup *g = e->g;
+
+	e->sec = g_sec;
+	e->s->node->hitsec = g_sec;
+
+	g->floor->tick = g_tick;
+
+	make_slot_variants (pb);
+
+	slot_variants *variant = &g_shard->frame;
+	slot_variants *parts = member_variants (g);
+
+	if (!g_fanout_threads || fanout_plan (g)->count < g_fanout_threshold || !fanout_post (g, parts, e->slotid))
+		fanout_inline (g, parts, e->slotid);
+
+	else
+		fanout_inline (g, parts, e->slotid, true);
+
+	for (int i=0; e->bScanner && i < g->nscanners; i++) {
+
+		talkgroup *sc = g->scanners[i].sc;
+
+		if (sc->ownerslot == e->slotid) {
+
+			sc->tick = g_tick;
+
+			fanout_inline (sc, variant, 0);
+		}
+	}
+}
+
+// true if the entry is for a stream from this address and slot
+
+bool stream_from (stream_entry const *e, sockaddr_in const &addr, dword slotid)
+{
+	return e->slotid == slotid && getinaddr(e->addr) == getinaddr(addr) && e->addr.sin_port == addr.sin_port;
+}
+
+// Sequence numbers and timing, on every frame of a cached stream. The window
+// remembers the last 32 sequence numbers received. Loss is the numbers skipped, less
+// those that turn up late. Jitter is RFC 3550's interarrival jitter with the sequence
+// number as the sender's clock, DMRD_FRAME_US a number.
+// With the sequence filter a number seen before is a duplicate, and with seq_filter =
+// late a frame more than g_seq_late behind the newest is too late to be played. Returns
+// false to drop the frame. The node and group are only counted while the entry is
+// current, a stale one's may have gone
+
+bool stream_track (stream_entry *e, int seq, u64 now)
+{
+	int ahead = (signed char) (seq - e->seq);
+
+	e->frames ++;
+
+	if (ahead > 0) {
+
+		dword gap = (dword) (now - e->last);
+
+		int d = (int) gap - ahead * DMRD_FRAME_US;		// transit time difference
+
+		e->jitter += (d < 0 ? -d : d) - ((e->jitter + 8) >> 4);
+
+		if (gap > e->maxgap)
+			e->maxgap = gap;
+
+		e->lost += ahead - 1;
+		e->last = now;
+
+		e->seen = ahead < 32 ? e->seen << ahead | 1 : 1;
+		e->seq = (byte) seq;
+
+		return true;
+	}
+
+	int behind = -ahead;
+
+	bool const bSeen = behind < 32 && (e->seen >> behind & 1);
+
+	if (!bSeen) {		// counted lost when it was skipped
+
+		if (e->lost)
+			e->lost --;
+
+		if (behind < 32)
+			e->seen |= (dword) 1 << behind;
+	}
+
+	if (!g_seq_filter)
+		return true;
+
+	bool const bCurrent = e->epoch == g_stream_epoch;
+
+	if (bSeen) {
+
+		g_seq_dropped_dups ++;
+
+		if (bCurrent) {
+
+			e->s->node->seq_dups ++;
+			e->g->seq_dups ++;
+		}
+
+		return false;
+	}
+
+	if (g_seq_filter == SEQ_FILTER_LATE && behind > g_seq_late) {
+
+		g_seq_dropped_late ++;
+
+		if (bCurrent) {
+
+			e->s->node->seq_late ++;
+			e->g->seq_late ++;
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+// remember a stream the slot is sending to its group. Only the group's owner gets here
+
+void stream_cache (dword streamid, sockaddr_in const &addr, slot *s, talkgroup *g, int seq)
+{
+	if (!streamid || (g_streams.size () >= MAX_STREAMS && !g_streams.find (streamid)))
+		return;
+
+	bool bNew;
+
+	stream_entry &e = g_streams.insert (streamid, &bNew);
+
+	if (bNew || !stream_from (&e, addr, s->slotid)) {	// the same stream keeps its window and counts, see stream_track()
+
+		u64 now = GetMicroseconds ();
+
+		e.seq = (byte) seq;
+		e.seen = 1;
+		e.frames = 1;
+		e.lost = 0;
+		e.jitter = 0;
+		e.maxgap = 0;
+		e.first = now;
+		e.last = now;
+	}
+
+	e.addr = addr;
+	e.slotid = s->slotid;
+	e.s = s;
+	e.g = g;
+	e.bScanner = false;
+
+	for (int i=0; i < g->nscanners; i++) {
+
+		if (g->scanners[i].sc->ownerslot == s->slotid)
+			e.bScanner = true;
+	}
+	e.epoch = g_stream_epoch;
+	e.sec = g_sec;
+}
+
+// log a finished stream's quality and add it to its node's and group's, when they're known
+
+void stream_report (dword streamid, stream_entry *e, node *n, talkgroup *g)
+{
+	dword jitter = e->jitter >> 4;
+	dword expected = e->frames + e->lost;
+	dword avg = e->frames > 1 ? (dword) ((e->last - e->first) / (e->frames - 1)) : 0;
+
+	log (&e->addr, "Stream %08X end, slotid %s, frames %u lost %u (%.1f%%) jitter %.1f ms interarrival %.1f/%.1f ms", streamid, slotid_str(e->slotid).c_str(), e->frames, e->lost, expected ? 100.0 * e->lost / expected : 0.0, jitter / 1000.0, avg / 1000.0, e->maxgap / 1000.0);
+
+	if (n)
+		n->qos.add (e->frames, e->lost, jitter);
+
+	if (g)
+		g->qos.add (e->frames, e->lost, jitter);
+}
+
+// end of stream from the slot on group g
+
+void stream_end (dword streamid, sockaddr_in const &addr, slot *s, talkgroup *g)
+{
+	stream_entry *e = streamid ? g_streams.find (streamid) : NULL;
+
+	if (e && stream_from (e, addr, s->slotid)) {
+
+		stream_report (streamid, e, s->node, g);
+
+		g_streams.remove (streamid);
+	}
+}
+
+// drop streams that stopped without an end of stream, returns how many
+
+int streams_expire ()
+{
+	int dropped = 0;
+
+	for (int i=0; i < g_streams.capacity (); ) {
+
+		stream_entry &e = g_streams.value (i);
+
+		if (g_streams.key (i) && g_sec - e.sec >= STREAM_IDLE_SECS) {
+
+			bool const bCurrent = e.epoch == g_stream_epoch;
+
+			stream_report (g_streams.key (i), &e, bCurrent ? e.s->node : NULL, bCurrent ? e.g : NULL);
+
+			g_streams.remove (g_streams.key (i));		// may move another entry into i
+
+			dropped ++;
+		}
+
+		else
+			i ++;
+	}
+
+	return dropped;
+}
+
+// handle all received packets
+
+void handle_rx (sockaddr_in &addr, pkt_buf *pb)
+{
+	byte *pk = pb->data;
+
+	int pksize = pb->size;
+
+	if (pksize == 55 && memcmp(pk, "DMRD", 4)==0) {		// DMR radio audio payload
+
+		dword const radioid = get3(pk + 5);	// radio ID
+
+		dword const tg = get3 (pk + 8);	// tg or private call peer
+
+		dword const nodeid = get4(pk + 11);	// the pistar ID
+
+		dword const streamid = get4(pk + 16);		// stream ID
+
+		int const flags = pk[15];		// start/stop stream and frame number and slot
+
+		bool const bStartStream = (flags & 0x23) == 0x21;
+
+		bool const bEndStream = (flags & 0x23) == 0x22;
+
+		bool const bPrivateCall = (flags & 0x40) == 0x40;
+
+		dword const slotid = SLOTID(nodeid, flags & 0x80);
+
+		if (g_debug)
+			printf ("node %d slot %d radio %d group %d stream %08X flags %02X\n\n", nodeid, SLOT(slotid)+1, radioid, tg, streamid, flags);
+
+		if (!bPrivateCall && !bEndStream) {		// group frame, see stream_entry
+
+			stream_entry *e = g_streams.find (streamid);
+
+			if (e && stream_from (e, addr, slotid)) {
+
+				if (!stream_track (e, pk[4], GetMicroseconds ()))
+					return;
+
+				// a stale entry's frame goes through all of handle_rx(), which makes it
+				// current again or drops it
+
+				if (e->epoch == g_stream_epoch && !bStartStream) {
+
+					g_stream_hits ++;
+
+					stream_relay (e, pb);
+					return;
+				}
+			}
+
+			if (!bStartStream)
+				g_stream_misses ++;
+		}
+
+		slot *s = findslot (slotid, false);		// nodes are only made by the control thread
+
+		if (!s || !s->node->bAuth) {		// node hasn't logged in or been authenticated?
+
+			g_dmrd_rejected ++;
+
+			if (g_debug)
+				log (&addr, "Node %d not authenticated for DMRD\n", nodeid);
+
+			return;
+		}
+
+		if (getinaddr(s->node->addr) != getinaddr(addr)) {	// coming from a bogus IP?
+
+			log (&addr, "Node %d invalid IP DMRD. Should be %s\n", nodeid, my_inet_ntoa(addr.sin_addr).c_str());
+			return;
+		}
+
+		node_moved (s->node, addr);	// update IP
+
+		s->node->hitsec = g_sec;
+
+		radio_heard (radioid, slotid);
+
+		if (tg == UNSUBSCRIBE_ALL_TG) {		// unsubscribe only?
+
+			if (bStartStream) {
+
+				log (&addr, "Unsubscribe all, slotid %s\n", slotid_str(slotid).c_str());
+				unsubscribe_from_group (s);
+			}
+
+			return;
+		}
+
+		if (bPrivateCall) {		// private call?
+
+			if (tg == radioid) {	// if to self, then this is a parrot
+
+				if (bEndStream) {	// done?
+
+					log (&addr, "Parrot stream end on nodeid %u slotid %s radioid %u\n", nodeid, slotid_str(slotid).c_str(), radioid);
+
+					// is the parrot really running?
+
+					if (s->parrot) {
+
+						parrot_record (s->parrot, pb, true);
+
+						// hand it off to the parrot timer
+
+						parrot_rec *r = s->parrot;
+
+						r->addr = s->node->addr;
+						s->parrot = NULL;
+
+						timer_stop (&s->parrot_limit);
+
+						start_parrot_playback (r);		// the timer will echo the packets back
+					}
+				}
+
+				else {
+
+					if (bStartStream) {	// start parrot?
+
+						log (&addr, "Parrot stream start on nodeid %u slotid %s radioid %u\n", nodeid, slotid_str(slotid).c_str(), radioid);
+
+						unsubscribe_from_group (s);
+
+						// My pistar always has two flags==0xE1 packets, so it's possible we've already started the parrot
+
+						if (!s->parrot) {	
+
+							// a recording that never ends is freed with its node
+
+							s->parrot = g_parrot_pool.alloc ();
+							s->parrotseq ++;
+							s->bParrotFull = false;
+
+							timer_start (&s->parrot_limit, PARROT_LIMIT_MS, parrot_limit_event, s);
+						}
+					}
+
+					if (s->parrot && !s->bParrotFull) {		// limit duration
+
+						parrot_record (s->parrot, pb, false);
+					}
+				}
+			}
+
+			else {		// private call
+
+				// see if we can locate the radio
+
+				unsubscribe_from_group (s);
+
+				if (bStartStream) {
+
+					log (&addr, "Private stream start, from radioid %u to radioid %u\n", radioid, tg);
+				}
+
+				else if (bEndStream) {
+
+					log (&addr, "Private stream end, from radioid %u to radioid %u\n", radioid, tg);
+				}
+
+				radio_loc const *r = g_radios.find (tg);
+
+				int loc, sent = 0;
+
+				for (loc=0; r && loc < RADIO_LOCATIONS && r->slotid[loc]; loc++) {
+
+					if (g_sec - r->sec[loc] >= (dword) g_radio_ttl)
+						continue;
+
+					dword slotid = r->slotid[loc];
+
+					slot const *dest = findslot (slotid, false);
+
+					if (!dest) {
+
+						if (bStartStream || bEndStream) {
+
+							log (&addr, "Private stream dest slotid %s not found, from radioid %u to radioid %u\n", slotid_str(slotid).c_str(), radioid, tg);
+						}
+
+						continue;
+					}
+
+					if (bStartStream || bEndStream) {
+
+						log (&addr, "Private stream dest slotid %s found, from radioid %u to radioid %u\n", slotid_str(slotid).c_str(), radioid, tg);
+					}
+
+					if (SLOT(slotid))
+						pk[15] |= 0x80;
+
+					else
+						pk[15] &= 0x7F;
+
+					sendpacket (dest->node->addr, pk, pksize);
+
+					sent ++;
+				}
+
+				if (sent)
+					g_private_frames ++;
+
+				else {
+
+					g_private_unrouted ++;
+
+					if (bStartStream || bEndStream) {
+
+						log (&addr, "Private stream dest radioid not heard, from radioid %u to radioid %u\n", radioid, tg);
+					}
+				}
+			}
+		}
+
+		else {	// talkgroup 
+
+			talkgroup *g = findgroup (tg, false);
+
+			if (!g && tg_allowed (tg) && (g = findgroup (tg, true)) != NULL) {
+
+				log (&addr, "Make group %u, nodeid %u radioid %u\n", tg, nodeid, radioid);
+
+				g_groups_made ++;
+			}
+
+			if (g) {	// group exists?
+
+				subscribe_to_group(s, g);		// joins it if not already subscribed
+
+				if (!g->bScanner) {
+
+					slot_variants *variant = &g_shard->frame;	// the packet for slot 1 and slot 2 destinations, sent after routing
+
+					make_slot_variants (pb);
+
+					// a silent owner is released by the owner timer, see owner_timeout_event()
+
+					talkgroup *f = g->floor;	// the owner of a bridged group is its bridge's
+
+					if (bStartStream && !f->ownerslot) {
+
+						log (&addr, "Take group %u, nodeid %u slotid %s radioid %u", tg, nodeid, slotid_str(slotid).c_str(), radioid);
+							
+						take_group (g, slotid);
+					}
+
+					else if (bEndStream && f->ownerslot == slotid) {
+
+						log (&addr, "Drop group %u, nodeid %u slotid %s radioid %u", tg, nodeid, slotid_str(slotid).c_str(), radioid);
+
+						release_group (g);
+					}
+					
+					if (slotid == f->ownerslot) {
+
+						f->tick = g_tick;
+
+						// relay packet to subscribers, very large groups go to the sender pool
+
+						slot_variants *parts = member_variants (g);
+
+						if (!g_fanout_threads || fanout_plan (g)->count < g_fanout_threshold || !fanout_post (g, parts, slotid))
+							fanout_inline (g, parts, slotid);		// don't send packet back to sender
+
+						else
+							fanout_inline (g, parts, slotid, true);
+					}
+
+					// the scanners that follow this group, none for most groups
+
+					for (int k=0; k < g->nscanners; k++) {
+
+						talkgroup *sc = g->scanners[k].sc;
+						int const prio = g->scanners[k].prio;
+
+						// if slot owns scanner and end of stream, or owner timed out, drop ownership
+
+						if (s->slotid == sc->ownerslot && bEndStream) {
+
+							log (&addr, "Drop scanner %u, nodeid %u slotid %s radioid %u", sc->tg, nodeid, slotid_str(slotid).c_str(), radioid);
+
+							release_group (sc);
+						}
+
+						// if nobody owns the scanner, or a stream on a lower priority group does, and this
+						// isn't the end of a stream, take tx ownership
+
+						if (!bEndStream && (!sc->ownerslot || (bStartStream && sc->ownerslot != s->slotid && prio < sc->scanprio))) {
+
+							log (&addr, "Take scanner %u, TG %u priority %d, nodeid %u slotid %s radioid %u", sc->tg, tg, prio, nodeid, slotid_str(slotid).c_str(), radioid);
+
+							take_group (sc, s->slotid);
+
+							sc->scanprio = prio;
+						}
+
+						// if current slot is current scanner stream, relay the packet to scanner subscribers
+
+						if (s->slotid == sc->ownerslot) {
+
+							sc->tick = g_tick;
+
+							fanout_inline (sc, variant, 0);
+						}
+					}
+
+					// the rest of the stream can skip all of the above
+
+					if (bEndStream)
+						stream_end (streamid, addr, s, g);
+
+					else if (slotid == g->floor->ownerslot)
+						stream_cache (streamid, addr, s, g, pk[4]);
+				}
+			}
+
+			else {
+
+				if (bStartStream)
+					log (&addr, "Nodeid %u keyup on non-existent group %u", nodeid, tg);
+
+				unsubscribe_from_group (s);
+			}
+		}
+	}
+
+	else if (pksize == 11 && memcmp(pk, "RPTPING", 7)==0) {
+
+		dword nodeid = get4(pk + 7);
+
+		node *n = findnode (nodeid, false);
+
+		if (n && n->bAuth && getinaddr(addr) == getinaddr(n->addr)) {
+
+			n->hitsec = g_sec;
+			memcpy (pk, "MSTPONG", 7);
+			set4 (pk+7, nodeid);
+			sendpacket (addr, pk, 11);
+		}
+
+		else {
+
+			memcpy (pk, "MSTNAK", 6);
+			set4 (pk+6, nodeid);
+			sendpacket (addr, pk, 10);
+		}
+	}
+
+	dump_groups();
+}
+
+// Control plane. Logins, authentication, node config, logout and status queries are
+// queued by the shards for the control thread, so a login storm can't hold up voice.
+// The control thread owns the node state transitions. It only holds g_state_lock to
+// look up and change nodes; hashing, logging and replies happen outside it. The data
+// path never creates nodes, it only reads the authenticated ones.
+
+bool is_control_packet (byte const *pk, int sz)
+{
+	return (sz == 8 && memcmp(pk, "RPTL", 4)==0) ||
+		(sz == 40 && memcmp(pk, "RPTK", 4)==0) ||
+		(sz == 302 && memcmp(pk, "RPTC", 4)==0) ||
+		(sz == 9 && memcmp(pk, "RPTCL", 5)==0) ||
+		(sz >= 5 && memcmp(pk, "/STAT", 5)==0);
+}
+
+// queue a control packet for the control thread, dropped if it's backed up
+
+void ctl_post (sockaddr_in const &addr, byte const *pk, int pksize)
+{
+	spsc_ring<ctl_packet> &q = g_ctlq[g_shard->ix];
+
+	ctl_packet *p = q.reserve ();
+
+	if (!p) {
+
+		ATOMIC_ADD (&g_ctl_dropped, 1);		// the node will retry
+		return;
+	}
+
+	p->addr = addr;
+	p->size = pksize < CTL_PACKET_SIZE ? pksize : CTL_PACKET_SIZE;
+
+	memcpy (p->buf, pk, p->size);
+
+	q.commit ();
+
+	g_ctl_sem.post ();
+}
+
+void handle_control (sockaddr_in &addr, byte *pk, int pksize)
+{
+	if (pksize == 8 && memcmp(pk, "RPTL", 4)==0) {		// login
+
+		dword nodeid = get4(pk + 4);
+
+		log (&addr, "RPTL node %d\n", nodeid);
+
+		g_state_lock.lock ();
+
+		node *n = findnode (nodeid, false);
+
+		if (n) {		// node exists?
+
+			// if already authenticated at a different IP then reject
+
+			if (n->bAuth && getinaddr(addr) != getinaddr(n->addr)) {
+
+				sockaddr_in was = n->addr;
+
+				g_state_lock.unlock ();
+
+				log (&addr, "Node %d already logged in at %s\n", nodeid, my_inet_ntoa(was.sin_addr).c_str());
+				return;
+			}
+		}
+
+		if (!n) {
+
+			n = findnode (nodeid, true);
+		}
+
+		if (!n) {
+
+			g_state_lock.unlock ();
+
+			log (&addr, "Node %d out of range for RPTL\n", nodeid);
+			return;
+		}
+
+		n->hitsec = g_sec;
+
+		if (!getinaddr(n->addr)) {
+
+			node_moved (n, addr);
+		}
+
+		n->salt = ((dword)rand() << 16) ^ g_tick;	// reasonably random salt for RPTK authentication
+
+		dword salt = n->salt;
+
+		g_state_lock.unlock ();
+
+		memcpy (pk, "RPTACK", 6);
+
+		*(dword*)(pk + 6) = salt;
+
+		sendpacket (addr, pk, 10);
+	}
+
+	else if (pksize == 40 && memcmp(pk, "RPTK", 4)==0) {		// authentication data
+
+		dword nodeid = get4(pk + 4);
+
+		log (&addr, "RPTK node %d\n", nodeid);
+
+		g_state_lock.lock ();
+
+		node *n = findnode(nodeid, false);
+
+		if (!n) {
+
+			g_state_lock.unlock ();
+
+			log (&addr, "Node %d not found for RPTK", nodeid);
+			return;
+		}
+
+		if (getinaddr(n->addr) != getinaddr(addr)) {
+
+			sockaddr_in was = n->addr;
+
+			g_state_lock.unlock ();
+
+			log (&addr, "Invalid RPTK IP address for node %d, should be %s\n", nodeid, my_inet_ntoa(was.sin_addr).c_str());
+			return;
+		}
+
+		n->hitsec = g_sec;
+
+		bool bAuth = n->bAuth;
+
+		dword salt = n->salt;
+
+		if (bAuth)
+			node_moved (n, addr);	// logging in again, maybe from a new NAT port
+
+		g_state_lock.unlock ();
+
+		if (!bAuth) {
+
+			byte const * remotehash = pk + 8;
+
+			byte localhash[32];
+
+			char temp[MAX_PASSWORD_SIZE + 10];
+			
+			*(dword*)temp = salt;
+
+			strcpy (temp + sizeof(salt), g_password);
+
+			make_sha256_hash (temp, sizeof(salt) + strlen(g_password), localhash, NULL, 0);
 
 			if (memcmp(localhash, remotehash, 32)==0) {
 
-				n->bAuth = true;
+				g_state_lock.lock ();
+
+				n = findnode (nodeid, false);	// it may have gone or logged in again meanwhile
+
+				if (n && n->salt == salt && getinaddr(n->addr) == getinaddr(addr)) {
+
+					if (!n->bAuth)
+						auth_filter_add (addr);
+
+					n->bAuth = true;
+
+					node_moved (n, addr);
+
+					g_stream_epoch ++;
+
+					subscribe_static (n);
+
+					bAuth = true;
+				}
+
+				g_state_lock.unlock ();
+			}
+		}
+
+		memcpy (pk, bAuth ? "RPTACK" : "MSTNAK", 6);
+
+		if (!bAuth)
+			log (&addr, "Authentication failed");
+
+		set4 (pk + 6, nodeid);
+
+		sendpacket (addr, pk, 10);
+	}
+
+	else if (pksize == 302 && memcmp(pk, "RPTC", 4)==0) {		// node description stuff, like callsign and location
+
+		dword nodeid = get4(pk + 4);
+
+		log (&addr, "RPTC node %d\n", nodeid);
+
+		g_state_lock.lock ();
+
+		node *n = findnode (nodeid, false);
+
+		if (!n) {
+
+			g_state_lock.unlock ();
+
+			log (&addr, "Node %d not found for RPTC", nodeid);
+			return;
+		}
+
+		if (getinaddr(n->addr) != getinaddr(addr)) {
+
+			sockaddr_in was = n->addr;
+
+			g_state_lock.unlock ();
+
+			log (&addr, "Invalid RPTC IP address for node %d, should be %s\n", nodeid, my_inet_ntoa(was.sin_addr).c_str());
+			return;
+		}
+
+		n->hitsec = g_sec;
+
+		if (n->bAuth)
+			node_moved (n, addr);
+
+		g_state_lock.unlock ();
+
+		memcpy (pk, "RPTACK", 6);
+		set4(pk + 6, nodeid);
+		sendpacket (addr, pk, 10);
+	}
+
+	else if (pksize == 9 && memcmp(pk, "RPTCL", 5)==0) {		// remove all trace of node
+
+		dword nodeid = get4(pk + 5);
+
+		log (&addr, "RPTCL node %d\n", nodeid);
+
+		g_state_lock.lock ();
+
+		node *n = findnode (nodeid, false);
+
+		if (!n) {
+
+			g_state_lock.unlock ();
+
+			log (&addr, "Node %d doesn't exist for RPTCL", nodeid);
+			return;
+		}
+
+		if (getinaddr(addr) == getinaddr(n->addr)) {
+	
+			delete_node (nodeid);
+
+			g_state_lock.unlock ();
+		}
+
+		else {
+
+			sockaddr_in was = n->addr;
+
+			g_state_lock.unlock ();
+
+			log (&addr, "Invalid RPTCL IP address for node %d, should be %s\n", nodeid, my_inet_ntoa(was.sin_addr).c_str());
+		}
+	}
+
+	else if (pksize >= 5 && memcmp(pk, "/STAT", 5)==0) {		// return status to local query
+
+		if ((ntohl (getinaddr (addr)) >> 24) != 127)
+			return;		// show_running_status() asks from loopback, nobody else gets an answer
+
+		std::string str;
+
+		g_state_lock.lock ();
+
+		_dump_stats(str);
+
+		g_state_lock.unlock ();
+
+		_dump_nodes(str);
+
+		// in datagrams of up to MAX_STATUS_SIZE, cut between lines, and no more than
+		// MAX_STATUS_DATAGRAMS of them. The client reads until they stop coming
+
+		char const *p = str.c_str();
+		int left = str.size(), sent = 0;
+
+		while (left > 0 && sent++ < MAX_STATUS_DATAGRAMS) {
+
+			int sz = left < MAX_STATUS_SIZE ? left : MAX_STATUS_SIZE;
+
+			if (sz < left) {
+
+				while (sz > 1 && p[sz-1] != '\n')
+					sz --;
+
+				if (p[sz-1] != '\n')
+					sz = MAX_STATUS_SIZE;		// a line longer than a datagram
+			}
+
+			sendpacket (addr, p, sz);
+
+			p += sz;
+			left -= sz;
+		}
+	}
+}
+
+PTHREAD_PROC(control_thread_proc)
+{
+	g_shard = &g_control;
+
+	for (;;) {
+
+		g_ctl_sem.wait ();
+
+		for (int i=0; i < g_shard_count; i++) {
+
+			spsc_ring<ctl_packet> &q = g_ctlq[i];
+
+			while (q.avail () > 0) {
+
+				ctl_packet &p = q.at (0);
+
+				handle_control (p.addr, p.buf, p.size);
+
+				q.consume (1);
+
+				g_ctl_packets ++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void start_control_thread ()
+{
+	g_ctlq = new spsc_ring<ctl_packet>[g_shard_count];
+
+	for (int i=0; i < g_shard_count; i++)
+		g_ctlq[i].init (CTL_QUEUE_SIZE);
+
+	g_control.sock = g_sock;
+
+	pthread_t th;
+
+	pthread_create (&th, NULL, control_thread_proc, NULL);
+}
+
+// received datagram, show it if debugging then process it
+
+// route a received datagram. pb is the packet buffer it was received into, the caller
+// keeps its reference. Without one (the pipeline's RX queue, an io_uring buffer) a
+// DMRD packet is copied into a packet buffer first, so it can be shared like the rest
+
+void dispatch_rx (sockaddr_in &addr, byte *buf, int sz, pkt_buf *pb)
+{
+	static dword seq = 1;
+
+	if (g_debug) {
+
+		char temp[100];
+
+		sprintf (temp, "RX%u", seq++);
+
+		show_packet (temp, my_inet_ntoa (addr.sin_addr).c_str(), buf, sz);
+	}
+
+	if (is_control_packet (buf, sz)) {
+
+		ctl_post (addr, buf, sz);
+		return;
+	}
+
+	pkt_buf *copy = NULL;
+
+	if (!pb) {
+
+		if (!(pb = copy = g_shard->pkts.alloc (true)))
+			pb = &g_shard->rx_scratch;
+
+		memcpy (pb->data, buf, sz);
+
+		pb->size = sz;
+	}
+
+	g_state_lock.lock ();
+
+	handle_rx (addr, pb);
+
+	g_state_lock.unlock ();
+
+	tx_flush ();	// fan-out is sent outside the lock
+
+	for (int i=0; i < 2; i++) {		// done with the other slot's copy, see make_slot_variants()
+
+		if (g_shard->frame[i] && g_shard->frame[i] != pb)
+			g_shard->pkts.release_local (g_shard->frame[i], PKT_RX);
+
+		g_shard->frame[i] = NULL;
+	}
+
+	while (g_shard->ncopies)		// and the bridge members', see member_variants()
+		g_shard->pkts.release_local (g_shard->copies[--g_shard->ncopies], PKT_RX);
+
+	if (copy)
+		g_shard->pkts.release_local (copy, PKT_RX);
+}
+
+// a receive buffer somebody kept a reference to is given up, the slot gets a new one
+
+void rx_recycle (pkt_buf *&pb)
+{
+	if (pb && g_shard->pkts.shared (pb)) {
+
+		g_shard->pkts.release_local (pb, PKT_RX);
+
+		pb = NULL;
+	}
+}
+
+// one recvfrom() per datagram. Used when batching is off or not supported
+
+void receive_single ()
+{
+	if (!g_shard->rx_pb)
+		g_shard->rx_pb = g_shard->pkts.alloc (true);
+
+	pkt_buf *pb = g_shard->rx_pb ? g_shard->rx_pb : &g_shard->rx_scratch;
+
+	sockaddr_in addr;
+
+	socklen_t addrlen = sizeof(addr);
+
+	int sz = recvfrom (g_shard->sock, (char*) pb->data, RX_BUFSIZE, 0, (sockaddr*)&addr, &addrlen);
+
+	g_shard->rxstats.calls ++;
+
+	if (sz > 0) {
+
+		g_shard->rxstats.packets ++;
+
+		pb->size = sz;
+
+		dispatch_rx (addr, pb->data, sz, pb);
+
+		rx_recycle (g_shard->rx_pb);
+	}
+
+	else if (sz < 1) {
+
+		int err = GetInetError ();
+
+		g_shard->rxstats.errors ++;
+
+		log (&addr, "recvfrom error %d\n", err);
+
+		Sleep (50);
+	}
+}
+
+#ifdef LINUX
+
+void init_rx_batch ()
+{
+	g_shard->rx_slots = new rx_slot[MAX_RX_BATCH];
+	g_shard->rx_msgs = new mmsghdr[MAX_RX_BATCH];
+	g_shard->rx_iov = new iovec[MAX_RX_BATCH];
+
+	memset (g_shard->rx_msgs, 0, sizeof(mmsghdr) * MAX_RX_BATCH);
+
+	for (int i=0; i < MAX_RX_BATCH; i++) {
+
+		g_shard->rx_slots[i].pb = NULL;
+		g_shard->rx_iov[i].iov_len = RX_BUFSIZE;
+
+		g_shard->rx_msgs[i].msg_hdr.msg_iov = &g_shard->rx_iov[i];
+		g_shard->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+		g_shard->rx_msgs[i].msg_hdr.msg_name = &g_shard->rx_slots[i].addr;
+	}
+}
+
+// drain up to the current batch size of datagrams in one call, then adapt the batch size:
+// double it when the batch came back full, halve it when it was mostly empty.
+// Returns the number of datagrams received
+
+int receive_batch ()
+{
+	int batch = g_shard->rxstats.batch, i;
+
+	for (i=0; i < batch; i++) {
+
+		rx_slot &r = g_shard->rx_slots[i];
+
+		if (!r.pb && !(r.pb = g_shard->pkts.alloc (true)))
+			break;		// out of packet buffers, receive into the slots we have
+
+		g_shard->rx_iov[i].iov_base = r.pb->data;
+		g_shard->rx_msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);		// recvmmsg() overwrites these
+	}
+
+	if (!i) {
+
+		receive_single ();
+		return 1;
+	}
+
+	batch = i;
+
+	int n = recvmmsg (g_shard->sock, g_shard->rx_msgs, batch, MSG_DONTWAIT, NULL);
+
+	g_shard->rxstats.calls ++;
+
+	if (n < 1) {
+
+		int err = GetInetError ();
+
+		if (err == ENOSYS) {	// kernel too old, go back to recvfrom()
+
+			log (NULL, "recvmmsg not supported, batch receive disabled\n");
+
+			g_rx_batch = 1;
+		}
+
+		else if (err != EAGAIN && err != EWOULDBLOCK) {
+
+			g_shard->rxstats.errors ++;
+
+			log (NULL, "recvmmsg error %d\n", err);
+
+			Sleep (50);
+		}
+
+		return 0;
+	}
+
+	g_shard->rxstats.packets += n;
+
+	if (n > g_shard->rxstats.peak)
+		g_shard->rxstats.peak = n;
+
+	for (int j=0; j < n; j++) {
+
+		rx_slot &r = g_shard->rx_slots[j];
+
+		r.pb->size = g_shard->rx_msgs[j].msg_len;
+
+		dispatch_rx (r.addr, r.pb->data, r.pb->size, r.pb);
+
+		rx_recycle (r.pb);
+	}
+
+	if (n == batch) {
+
+		g_shard->rxstats.full ++;
+
+		if (batch < g_rx_batch)
+			g_shard->rxstats.batch = batch * 2 < g_rx_batch ? batch * 2 : g_rx_batch;
+	}
+
+	else if (n < batch / 4 && batch > 1) {
+
+		g_shard->rxstats.batch = batch / 2;
+	}
+
+	return n;
+}
+
+bool pin_thread (int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+
+	int err = pthread_setaffinity_np (pthread_self(), sizeof(set), &set);
+
+	if (err) {
+
+		log (NULL, "Can't pin thread to CPU %d (%d)\n", cpu, err);
+		return false;
+	}
+
+	log (NULL, "Thread pinned to CPU %d\n", cpu);
+	return true;
+}
+
+// pipeline stages, see struct rx_packet
+
+// true if handle_rx() has a use for the datagram
+
+bool rx_classify (byte const *pk, int sz)
+{
+	if (sz >= 5 && memcmp (pk, "/STAT", 5) == 0)
+		return true;
+
+	switch (sz) {
+
+		case 55:	return memcmp (pk, "DMRD", 4) == 0;
+		case 8:		return memcmp (pk, "RPTL", 4) == 0;
+		case 40:	return memcmp (pk, "RPTK", 4) == 0;
+		case 302:	return memcmp (pk, "RPTC", 4) == 0;
+		case 11:	return memcmp (pk, "RPTPING", 7) == 0;
+		case 9:		return memcmp (pk, "RPTCL", 5) == 0;
+	}
+
+	return false;
+}
+
+// RX thread, receives straight into free rxq slots
+
+PTHREAD_PROC(rx_thread_proc)
+{
+	shard *sh = (shard*) threadcookie;
+
+	spsc_ring<rx_packet> &q = *sh->rxq;
+
+	mmsghdr *msgs = new mmsghdr[MAX_RX_BATCH];
+	iovec *iov = new iovec[MAX_RX_BATCH];
+
+	memset (msgs, 0, sizeof(mmsghdr) * MAX_RX_BATCH);
+
+	if (g_cpu >= 0)
+		pin_thread (g_cpu + sh->ix);
+
+	for (;;) {
+
+		int batch = q.space (g_rx_batch);
+
+		if (!batch) {		// routing thread is behind
+
+			sh->rx_full ++;
+
+			Sleep (1);
+			continue;
+		}
+
+		if (batch > g_rx_batch)
+			batch = g_rx_batch;
+
+		int i;
+
+		for (i=0; i < batch; i++) {
+
+			rx_packet &p = q.fill (i);
+
+			iov[i].iov_base = p.buf;
+			iov[i].iov_len = RX_BUFSIZE;
+
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &p.addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		}
+
+		int n = recvmmsg (sh->sock, msgs, batch, g_busy_poll ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+
+		sh->rxstats.calls ++;
+
+		sh->loops ++;
+
+		if (n < 1) {
+
+			int err = GetInetError ();
+
+			if (err == EAGAIN || err == EWOULDBLOCK)	// busy polling
+				sh->idle ++;
+
+			else if (err != EINTR) {
+
+				sh->rxstats.errors ++;
+
+				log (NULL, "recvmmsg error %d\n", err);
+
+				Sleep (50);
+			}
+
+			continue;
+		}
+
+		sh->rxstats.packets += n;
+
+		if (n > sh->rxstats.peak)
+			sh->rxstats.peak = n;
+
+		u64 now = GetMicroseconds ();
+
+		int kept = 0;
+
+		for (i=0; i < n; i++) {
+
+			rx_packet &p = q.fill (i);
+
+			p.size = msgs[i].msg_len;
+
+			if (!rx_classify (p.buf, p.size)) {
+
+				sh->rxstats.junk ++;
+				continue;
+			}
+
+			if (kept != i) {	// close the gap left by junk
+
+				rx_packet &to = q.fill (kept);
+
+				to.addr = p.addr;
+				to.size = p.size;
+
+				memcpy (to.buf, p.buf, p.size);
+			}
+
+			q.fill (kept).stamp = now;
+
+			kept ++;
+		}
+
+		if (kept) {
+
+			q.commit (kept);
+
+			u64 one = 1;
+
+			write (sh->rxfd, &one, sizeof(one));
+		}
+	}
+
+	return 0;
+}
+
+// routing stage, on the shard's own thread
+
+void pipe_rx_event (void *cookie)
+{
+	u64 count;
+
+	read (g_shard->rxfd, &count, sizeof(count));
+
+	spsc_ring<rx_packet> &q = *g_shard->rxq;
+
+	int n;
+
+	while ((n = q.avail ()) > 0) {
+
+		u64 now = GetMicroseconds ();
+
+		g_shard->rxstage.depth (n);
+
+		for (int i=0; i < n; i++) {
+
+			rx_packet &p = q.at (i);
+
+			g_shard->rxstage.took (now, p.stamp);
+
+			dispatch_rx (p.addr, p.buf, p.size, NULL);
+		}
+
+		q.consume (n);
+	}
+}
+
+// TX thread, sends straight from the descriptors in its queue
+
+PTHREAD_PROC(tx_thread_proc)
+{
+	tx_pipe *tp = (tx_pipe*) threadcookie;
+
+	for (;;) {
+
+		u64 count;
+
+		read (tp->fd, &count, sizeof(count));	// blocks until there's work
+
+		int n;
+
+		while ((n = tp->q.avail ()) > 0) {
+
+			u64 now = GetMicroseconds ();
+
+			tp->stage.depth (n);
+
+			if (n > g_tx_batch)
+				n = g_tx_batch;
+
+			int i;
+
+			for (i=0; i < n; i++) {
+
+				tx_desc &d = tp->q.at (i);
+
+				tp->stage.took (now, d.stamp);
+
+				tp->iov[i].iov_base = d.pb->data;
+				tp->iov[i].iov_len = d.pb->size;
+
+				memset (&tp->msgs[i].msg_hdr, 0, sizeof(tp->msgs[i].msg_hdr));
+
+				tp->msgs[i].msg_hdr.msg_name = &d.addr;
+				tp->msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				tp->msgs[i].msg_hdr.msg_iov = &tp->iov[i];
+				tp->msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			i = 0;
+
+			while (i < n) {
+
+				int sent = sendmmsg (tp->sock, tp->msgs + i, n - i, 0);
+
+				if (sent < 1) {
+
+					tp->stats.errors ++;	// the first datagram failed, skip it and carry on
+
+					sent = 1;
+				}
+
+				tx_count_batch (tp->stats, sent);
+
+				i += sent;
+			}
+
+			for (i=0; i < n; i++)
+				pkt_pool::release (tp->q.at (i).pb, PKT_PIPE);
+
+			tp->q.consume (n);
+		}
+	}
+
+	return 0;
+}
+
+// start the RX and TX threads for a shard, its thread does the routing
+
+bool start_pipeline (shard *sh)
+{
+	sh->rxq = new spsc_ring<rx_packet>;
+	sh->rxq->init (PIPE_RX_QUEUE);
+
+	if ((sh->rxfd = eventfd (0, EFD_NONBLOCK)) == -1)
+		return false;
+
+	sh->txp = new tx_pipe[g_tx_threads];
+
+	for (int i=0; i < g_tx_threads; i++) {
+
+		tx_pipe &tp = sh->txp[i];
+
+		tp.q.init (PIPE_TX_QUEUE);
+		tp.sock = sh->sock;
+
+		if ((tp.fd = eventfd (0, 0)) == -1)
+			return false;
+
+		pthread_create (&tp.thread, NULL, tx_thread_proc, &tp);
+	}
+
+	if (!(sh->rx_event = sh->r->add_socket (sh->rxfd, pipe_rx_event, NULL)))
+		return false;
+
+	pthread_create (&sh->rx_thread, NULL, rx_thread_proc, sh);
+
+	return true;
+}
+
+#endif
+
+#ifdef HAVE_IO_URING
+
+void rx_event (void *cookie);
+
+// multishot receive isn't supported (kernel < 6.0), go back to the socket path
+
+void uring_fallback ()
+{
+	log (NULL, "io_uring multishot receive not supported, using sockets\n");
+
+	g_shard->bUring = false;
+
+	g_shard->r->remove (g_shard->rx_event);
+
+	g_shard->rx_event = g_shard->r->add_socket (g_shard->sock, rx_event, NULL);
+}
+
+void uring_rx_event (void *cookie)
+{
+	io_uring_cqe *cqe;
+
+	int n = 0;
+
+	bool bRearm = false;
+
+	while ((cqe = g_shard->rx_ring.peek_cqe()) != NULL) {
+
+		int res = cqe->res;
+
+		unsigned flags = cqe->flags;
+
+		g_shard->rx_ring.cqe_seen ();
+
+		if (!(flags & IORING_CQE_F_MORE))	// receive is no longer armed
+			bRearm = true;
+
+		if (res < 0) {
+
+			if (res == -EINVAL && !g_shard->rxstats.packets) {
+
+				uring_fallback ();
+				return;
+			}
+
+			if (res != -ENOBUFS) {		// out of buffers just means we fell behind
+
+				g_shard->rxstats.errors ++;
+
+				log (NULL, "io_uring recvmsg error %d\n", -res);
+			}
+
+			continue;
+		}
+
+		if (!(flags & IORING_CQE_F_BUFFER))
+			continue;
+
+		int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+		byte *b = g_shard->rx_ring.buffer (bid);
+
+		io_uring_recvmsg_out const *o = (io_uring_recvmsg_out const *) b;
+
+		int hdr = sizeof(io_uring_recvmsg_out) + g_shard->uring_rx_msg.msg_namelen + g_shard->uring_rx_msg.msg_controllen;
+
+		if (res >= hdr && !(o->flags & MSG_TRUNC)) {
+
+			sockaddr_in addr;
+
+			memcpy (&addr, b + sizeof(io_uring_recvmsg_out), sizeof(addr));
+
+			n ++;
+
+			dispatch_rx (addr, b + hdr, res - hdr, NULL);
+		}
+
+		g_shard->rx_ring.recycle (bid);
+	}
+
+	g_shard->rxstats.calls ++;
+	g_shard->rxstats.packets += n;
+
+	if (n > g_shard->rxstats.peak)
+		g_shard->rxstats.peak = n;
+
+	if (bRearm && !uring_arm_recv ())
+		log (NULL, "io_uring recvmsg re-arm failed (%d)\n", GetInetError());
+}
+
+#endif
+
+void rx_event (void *cookie)
+{
+#ifdef LINUX
+	if (g_rx_batch > 1)
+		receive_batch ();
+	else
+#endif
+		receive_single ();
+}
+
+void wheel_timer_event (void *cookie)
+{
+	g_state_lock.lock ();
 
-				n->addr = addr;
-			}
-		}
+	g_wheel.advance (wheel_tick ());
 
-		memcpy (pk, n->bAuth ? "RPTACK" : "MSTNAK", 6);
+	if (!g_wheel.count ())
+		g_reactor.set_timer (g_wheel_timer, 0);
 
-		if (!n->bAuth)
-			log (&addr, "Authentication failed");
+	g_state_lock.unlock ();
+}
 
-		set4 (pk + 6, nodeid);
+void housekeeping_timer_event (void *cookie)
+{
+	g_state_lock.lock ();
 
-		sendpacket (addr, pk, 10);
+	do_housekeeping();
+
+	g_state_lock.unlock ();
+}
+
+// open a socket per shard on the server port. With more than one shard they share the
+// port with SO_REUSEPORT, and a reuseport BPF program picks the socket for each datagram
+// from the source address: shard = address % shards, the same as home_shard()
+
+bool open_shards ()
+{
+	for (int i=0; i < g_shard_count; i++) {
+
+		g_shards[i].ix = i;
+
+		if ((g_shards[i].sock = open_udp (g_udp_port, g_shard_count > 1)) == -1)
+			return false;
 	}
 
-	else if (pksize == 302 && memcmp(pk, "RPTC", 4)==0) {		// node description stuff, like callsign and location
+	g_sock = g_shards[0].sock;
 
-		dword nodeid = get4(pk + 4);
+#ifdef LINUX
+	if (g_busy_poll) {
 
-		log (&addr, "RPTC node %d\n", nodeid);
+		for (int k=0; k < g_shard_count; k++) {
 
-		node *n = findnode (nodeid, false);
+			int on = true;
 
-		if (!n) {
+			if (setsockopt (g_shards[k].sock, SOL_SOCKET, SO_BUSY_POLL, (char*) &g_busy_poll_us, sizeof(g_busy_poll_us)) == -1 ||
+				setsockopt (g_shards[k].sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, (char*) &on, sizeof(on)) == -1) {
 
-			log (&addr, "Node %d not found for RPTC", nodeid);
-			return;
+				log (NULL, "Kernel busy poll not available (%d), spinning in user space only\n", GetInetError());
+				break;
+			}
 		}
+	}
 
-		if (getinaddr(n->addr) != getinaddr(addr)) {
+	if (g_shard_count > 1) {
 
-			log (&addr, "Invalid RPTC IP address for node %d, should be %s\n", nodeid, my_inet_ntoa(n->addr.sin_addr).c_str());
-			return;
-		}
+		sock_filter code[] = {
 
-		n->hitsec = g_sec;
+			{BPF_LD | BPF_W | BPF_ABS, 0, 0, (__u32) (SKF_NET_OFF + 12)},	// source address
+			{BPF_ALU | BPF_MOD | BPF_K, 0, 0, (__u32) g_shard_count},
+			{BPF_RET | BPF_A, 0, 0, 0},
+		};
 
-		memcpy (pk, "RPTACK", 6);
-		set4(pk + 6, nodeid);
-		sendpacket (addr, pk, 10);
+		sock_fprog prog;
+
+		prog.len = sizeof(code) / sizeof(code[0]);
+		prog.filter = code;
+
+		if (setsockopt (g_sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+			log (NULL, "Reuseport BPF not supported (%d), shards picked by the kernel\n", GetInetError());
 	}
 
-	else if (pksize == 11 && memcmp(pk, "RPTPING", 7)==0) {
+	if (g_socket_filter)
+		attach_socket_filter ();
 
-		dword nodeid = get4(pk + 7);
+	if (g_shard_count > 1) {
 
-		node *n = findnode (nodeid, false);
+		for (int j=0; j < g_shard_count; j++) {
 
-		if (n && n->bAuth && getinaddr(addr) == getinaddr(n->addr)) {
+			shard &sh = g_shards[j];
 
-			n->hitsec = g_sec;
-			memcpy (pk, "MSTPONG", 7);
-			set4 (pk+7, nodeid);
-			sendpacket (addr, pk, 11);
-		}
+			sh.inbound = new spsc_ring<xshard_packet>[g_shard_count];
 
-		else {
+			for (int k=0; k < g_shard_count; k++)
+				sh.inbound[k].init (XSHARD_QUEUE_SIZE);
 
-			memcpy (pk, "MSTNAK", 6);
-			set4 (pk+6, nodeid);
-			sendpacket (addr, pk, 10);
+			if ((sh.wakefd = eventfd (0, EFD_NONBLOCK)) == -1)
+				return false;
 		}
 	}
+#endif
 
-	else if (pksize == 9 && memcmp(pk, "RPTCL", 5)==0) {		// remove all trace of node
+	return true;
+}
 
-		dword nodeid = get4(pk + 5);
+// set up the calling thread's shard on its event loop
 
-		log (&addr, "RPTCL node %d\n", nodeid);
+bool start_shard (shard *sh)
+{
+	g_shard = sh;
 
-		node *n = findnode (nodeid, false);
+	sh->pkts.init (g_packet_buffers, g_rx_batch + 1);		// reserve a buffer for each receive slot
 
-		if (!n) {
+#ifdef LINUX
+	if (g_rx_batch > 1 || g_busy_poll)
+		init_rx_batch ();
+#endif
 
-			log (&addr, "Node %d doesn't exist for RPTCL", nodeid);
-			return;
-		}
+#ifdef HAVE_IO_URING
+	if (g_io_backend == IO_BACKEND_URING) {
 
-		if (getinaddr(addr) == getinaddr(n->addr)) {
-	
-			delete_node (nodeid);
-		}
+		if (init_uring ()) {
 
-		else {
+			sh->bUring = true;
 
-			log (&addr, "Invalid RPTCL IP address for node %d, should be %s\n", nodeid, my_inet_ntoa(n->addr.sin_addr).c_str());
+			sh->rx_event = sh->r->add_socket (sh->rx_ring.fd(), uring_rx_event, NULL);
 		}
+
+		else
+			log (NULL, "io_uring not available (%d), using sockets\n", GetInetError());
 	}
+#else
+	if (g_io_backend == IO_BACKEND_URING)
+		log (NULL, "io_uring not supported by this build, using sockets\n");
+#endif
 
-	else if (pksize >= 5 && memcmp(pk, "/STAT", 5)==0) {		// return status to local query
+#ifdef LINUX
+	if (g_pipeline && sh->rx_event)
+		log (NULL, "Pipeline not used with io_uring\n");
 
-		char temp[500];
+	else if (g_pipeline && !start_pipeline (sh))
+		return false;
+#endif
 
-		std::string str;
+	if (!sh->rx_event)
+		sh->rx_event = sh->r->add_socket (sh->sock, rx_event, NULL);
 
-		_dump_nodes(str);
+	if (!sh->rx_event)
+		return false;
 
-		memset (temp, 0, sizeof(temp));
+#ifdef LINUX
+	if (g_shard_count > 1 && !(sh->wake_event = sh->r->add_socket (sh->wakefd, shard_wake_event, NULL)))
+		return false;
+#endif
 
-		strncpy ((char*)temp, str.c_str(), sizeof(temp)-1);
+	return true;
+}
 
-		sendpacket (addr, temp, strlen((char*)temp));
-	}
+#ifdef LINUX
 
-	dump_groups();
-}
+// busy poll. The socket is read without waiting, and the event loop is only checked
+// (without waiting) every BUSY_POLL_EVENTS iterations, so the thread never sleeps
 
-void run ()
+void busy_poll_loop (shard *sh)
 {
-	dword g_last_housekeeping_sec = 0;
+	for (;;) {
 
-	dword seq = 1;
+		sh->loops ++;
 
-	for (;;) {
+		if (!receive_batch ())
+			sh->idle ++;
 
-		if (select_rx(g_sock, 1)) {
+		if (!(sh->loops % BUSY_POLL_EVENTS))
+			sh->r->wait (0);
+	}
+}
 
-			byte buf[1000];
+#endif
 
-			sockaddr_in addr;
+// the shard's event loop, runs forever
 
-			socklen_t addrlen = sizeof(addr);
+void shard_loop (shard *sh)
+{
+#ifdef LINUX
+	if (!sh->rxq && g_cpu >= 0)		// pipelined, the RX thread is pinned instead
+		pin_thread (g_cpu + sh->ix);
 
-			int sz = recvfrom (g_sock, (char*) buf, sizeof(buf), 0, (sockaddr*)&addr, &addrlen);
+	if (g_busy_poll && !sh->rxq && sh->rx_event && sh->rx_msgs) {
 
-			if (sz > 0) {
+		bool bUring = false;
 
-				char ip[50];
-				
-				strcpy (ip, my_inet_ntoa (addr.sin_addr).c_str());
+#ifdef HAVE_IO_URING
+		bUring = sh->bUring;
+#endif
+		if (!bUring)
+			busy_poll_loop (sh);
+	}
+#endif
 
-				if (g_debug) {
+	for (;;)
+		sh->r->wait (-1);
+}
 
-					char temp[100];
+PTHREAD_PROC(shard_thread_proc)
+{
+	shard *sh = (shard*) threadcookie;
 
-					sprintf (temp, "RX%u", seq++);
+	sh->r = new reactor;
 
-					show_packet (temp, ip, buf, sz);
-				}
+	if (!sh->r->init() || !start_shard (sh)) {
 
-				handle_rx (addr, buf, sz);
-			}
+		log (NULL, "Failed to start shard %d (%d)\n", sh->ix, GetInetError());
+		return 0;
+	}
 
-			else if (sz < 1) {
+	shard_loop (sh);
 
-				int err = GetInetError ();
+	return 0;
+}
 
-				log (&addr, "recvfrom error %d\n", err);
+void run ()
+{
+	if (!g_reactor.init()) {
 
-				Sleep (50);
-			}
-		}
+		log (NULL, "Failed to create event loop (%d)\n", GetInetError());
+		return;
+	}
 
-		if (g_sec - g_last_housekeeping_sec >= g_housekeeping_minutes * 60) {
+	g_wheel_timer = g_reactor.add_timer (wheel_timer_event, NULL);
+	g_housekeeping_timer = g_reactor.add_timer (housekeeping_timer_event, NULL);
 
-			do_housekeeping();
+	g_shards[0].r = &g_reactor;
 
-			g_last_housekeeping_sec = g_sec;
-		}
+	start_control_thread ();
+
+	if (!g_wheel_timer || !g_housekeeping_timer || !start_shard (&g_shards[0])) {
+
+		log (NULL, "Failed to set up event loop (%d)\n", GetInetError());
+		return;
 	}
+
+	g_reactor.set_timer (g_housekeeping_timer, g_housekeeping_minutes * 60000, g_housekeeping_minutes * 60000);
+
+	start_fanout_threads ();
+
+	for (int i=1; i < g_shard_count; i++)
+		pthread_create (&g_shards[i].thread, NULL, shard_thread_proc, &g_shards[i]);
+
+	shard_loop (&g_shards[0]);
 }
 
 // query status from locally running server
@@ -1606,26 +5964,85 @@ bool show_running_status()
 		return false;
 	}
 
-	char buf[1001];
+	char buf[MAX_STATUS_SIZE + 1];
 
-	memset (buf, 0, sizeof(buf));
+	do {
+		memset (buf, 0, sizeof(buf));
 
-	int sz = recvfrom (sock, (char*) buf, sizeof(buf)-1, 0, NULL, 0);
+		int sz = recvfrom (sock, (char*) buf, sizeof(buf)-1, 0, NULL, 0);
 
-	if (sz == -1) {
+		if (sz == -1) {
 
-		printf ("recvfrom() failed (%d)\n", GetInetError());
-		CLOSESOCKET(sock);
-		return false;
-	}
+			printf ("recvfrom() failed (%d)\n", GetInetError());
+			CLOSESOCKET(sock);
+			return false;
+		}
+
+		fputs (buf, stdout);
 
-	puts (buf);
+	} while (select_rx (sock, 1));		// a long reply comes in several
+
+	puts ("");
 
 	CLOSESOCKET(sock);
 
 	return true;
 }
 
+bool is_scanner_tg (dword tg)
+{
+	for (int i=0; i < g_scanner_count; i++) {
+
+		if (g_scanner_defs[i].tg == tg)
+			return true;
+	}
+
+	return false;
+}
+
+// without [scanner N] sections, the one scanner on SCANNER_TG following every group.
+// Made before [static] and [bridges] are read, they mustn't take its group
+
+void default_scanner ()
+{
+	if (!g_scanner_count) {
+
+		g_scanner_defs[0].tg = SCANNER_TG;
+		g_scanner_defs[0].groups.set (1, HIGH_TG, true);
+		g_scanner_count = 1;
+	}
+}
+
+// a dmrd.conf list of groups like "100, 3100 91", returns how many went in tg
+
+int parse_groups (PCSTR v, dword *tg, int max, PCSTR what)
+{
+	int count = 0;
+
+	while (*v) {
+
+		char *p;
+
+		dword n = strtoul (v, &p, 10);
+
+		if (p == v) {		// separator
+
+			v ++;
+			continue;
+		}
+
+		v = p;
+
+		if (!inrange(n,1,HIGH_TG) || is_scanner_tg (n) || n == UNSUBSCRIBE_ALL_TG)
+			printf ("Config: bad group %u in %s\n", n, what);
+
+		else if (count < max)
+			tg[count++] = n;
+	}
+
+	return count;
+}
+
 void process_config_file()
 {
 	config_file c;
@@ -1636,10 +6053,213 @@ void process_config_file()
 		g_udp_port = c.getint ("general","udp_port", g_udp_port);
 		g_debug = c.getint("debug", "level", g_debug);
 		g_housekeeping_minutes = c.getint ("general","housekeeping_minutes", g_housekeeping_minutes);
+		g_rx_batch = c.getint ("general","rx_batch", g_rx_batch);
+		g_tx_batch = c.getint ("general","tx_batch", g_tx_batch);
+		g_shard_count = c.getint ("general","shards", g_shard_count);
+		g_fanout_threads = c.getint ("general","fanout_threads", g_fanout_threads);
+		g_fanout_threshold = c.getint ("general","fanout_threshold", g_fanout_threshold);
+		g_pipeline = c.getint ("general","pipeline", g_pipeline);
+		g_tx_threads = c.getint ("general","tx_threads", g_tx_threads);
+		g_busy_poll = c.getint ("general","busy_poll", g_busy_poll);
+		g_busy_poll_us = c.getint ("general","busy_poll_us", g_busy_poll_us);
+		g_cpu = c.getint ("general","cpu", g_cpu);
+		g_hugepages = c.getint ("general","hugepages", g_hugepages);
+		g_packet_buffers = c.getint ("general","packet_buffers", g_packet_buffers);
+		g_seq_late = c.getint ("general","seq_late", g_seq_late);
+		g_radio_ttl = c.getint ("general","radio_ttl", g_radio_ttl);
+		g_slot_groups = c.getint ("general","slot_groups", g_slot_groups);
+		g_subscription_minutes = c.getint ("general","subscription_minutes", g_subscription_minutes);
+		g_talkgroups_allowed = c.getstring ("general","talkgroups", g_talkgroups_allowed.c_str());
+		g_group_idle_minutes = c.getint ("general","group_idle_minutes", g_group_idle_minutes);
+
+		// [scanner N] include = ranges, exclude = ranges, priority = tg, tg ...
+
+		STRINGMAP_ITERATOR it;
+
+		for (it = c.values.begin(); it != c.values.end(); it++) {
+
+			std::string const &key = (*it).first;
+
+			if (key.compare (0, 8, "scanner ") != 0 || key.find ('|') == std::string::npos)
+				continue;
+
+			dword tg = strtoul (key.c_str() + 8, NULL, 10);
+
+			if (!inrange(tg,1,HIGH_TG) || tg == UNSUBSCRIBE_ALL_TG || is_scanner_tg (tg) || g_scanner_count >= MAX_SCANNERS)
+				continue;
+
+			std::string section = key.substr (0, key.find ('|'));
+
+			scanner_def &d = g_scanner_defs[g_scanner_count++];
+
+			d.tg = tg;
+
+			tg_range r[MAX_TG_RANGES];
+
+			int n = parse_ranges (c.getstring (section.c_str(), "include", "1-16777215").c_str(), r, MAX_TG_RANGES);
+
+			for (int i=0; i < n; i++)
+				d.groups.set (r[i].low, r[i].high, true);
+
+			n = parse_ranges (c.getstring (section.c_str(), "exclude", "").c_str(), r, MAX_TG_RANGES);
+
+			for (int j=0; j < n; j++)
+				d.groups.set (r[j].low, r[j].high, false);
+		}
+
+		for (int k=0; k < g_scanner_count; k++) {		// now every scanner's group is known
+
+			char section[30];
+
+			sprintf (section, "scanner %u", g_scanner_defs[k].tg);
+
+			g_scanner_defs[k].npriority = parse_groups (c.getstring (section, "priority", "").c_str(), g_scanner_defs[k].priority, MAX_SCANNER_PRIORITY, section);
+		}
+
+		default_scanner ();
+
+		// [static] nodeid:slot = tg, tg ... a bare nodeid is slot 2, the simplex hotspot slot
+
+		for (it = c.values.begin(); it != c.values.end(); it++) {
+
+			std::string const &key = (*it).first;
+
+			if (key.compare (0, 7, "static|") != 0)
+				continue;
+
+			char *p;
+			dword nodeid = strtoul (key.c_str() + 7, &p, 10);
+			int slotno = *p == ':' ? atoi (p+1) : 2;
+
+			if (!nodeid || !inrange(slotno,1,2)) {
+
+				printf ("Config: bad [static] node %s\n", key.c_str() + 7);
+				continue;
+			}
+
+			static_groups &sg = g_static_groups.insert (SLOTID(nodeid, slotno == 2));
+
+			sg.count = parse_groups ((*it).second.c_str(), sg.tg, MAX_SLOT_GROUPS, key.c_str());
+		}
+
+		// [bridges] name = tg, tg ...
+
+		for (it = c.values.begin(); it != c.values.end(); it++) {
+
+			std::string const &key = (*it).first;
+
+			if (key.compare (0, 8, "bridges|") != 0 || g_bridge_count >= MAX_BRIDGES)
+				continue;
+
+			bridge_def &b = g_bridges[g_bridge_count];
+
+			b.name = key.substr (8);
+			b.count = parse_groups ((*it).second.c_str(), b.tg, MAX_BRIDGE_GROUPS, key.c_str());
+
+			if (b.count > 1)
+				g_bridge_count ++;
+		}
+
+		std::string filter = c.getstring ("general","socket_filter","off");
+
+		if (eq(filter.c_str(), "shape") || eq(filter.c_str(), "1"))
+			g_socket_filter = SOCKET_FILTER_SHAPE;
+
+		if (eq(filter.c_str(), "auth") || eq(filter.c_str(), "2"))
+			g_socket_filter = SOCKET_FILTER_AUTH;
+
+		std::string seq = c.getstring ("general","seq_filter","off");
+
+		if (eq(seq.c_str(), "dup") || eq(seq.c_str(), "1"))
+			g_seq_filter = SEQ_FILTER_DUP;
+
+		if (eq(seq.c_str(), "late") || eq(seq.c_str(), "2"))
+			g_seq_filter = SEQ_FILTER_LATE;
+
+		std::string backend = c.getstring ("general","io_backend","socket");
+
+		if (eq(backend.c_str(), "uring") || eq(backend.c_str(), "io_uring"))
+			g_io_backend = IO_BACKEND_URING;
 	}
 
-	printf ("Config: debug %d, port %d, password %s, housekeeping minutes %d nodesize %d\n\n",
-				g_debug, g_udp_port, g_password, g_housekeeping_minutes, sizeof(node));
+	if (g_housekeeping_minutes < 1)
+		g_housekeeping_minutes = 1;
+
+	if (g_rx_batch < 1)
+		g_rx_batch = 1;
+
+	if (g_rx_batch > MAX_RX_BATCH)
+		g_rx_batch = MAX_RX_BATCH;
+
+	if (g_tx_batch < 1)
+		g_tx_batch = 1;
+
+	if (g_tx_batch > MAX_TX_BATCH)
+		g_tx_batch = MAX_TX_BATCH;
+
+#ifdef LINUX
+	if (g_shard_count < 1)
+		g_shard_count = 1;
+
+	if (g_shard_count > MAX_SHARDS)
+		g_shard_count = MAX_SHARDS;
+#else
+	g_shard_count = 1;		// needs SO_REUSEPORT
+#endif
+
+	if (g_fanout_threads < 0)
+		g_fanout_threads = 0;
+
+	if (g_fanout_threads > MAX_FANOUT_THREADS)
+		g_fanout_threads = MAX_FANOUT_THREADS;
+
+	if (g_fanout_threshold < 1)
+		g_fanout_threshold = 1;
+
+	if (g_tx_threads < 1)
+		g_tx_threads = 1;
+
+	if (g_tx_threads > MAX_TX_THREADS)
+		g_tx_threads = MAX_TX_THREADS;
+
+	if (g_packet_buffers < 2 * MAX_RX_BATCH)
+		g_packet_buffers = 2 * MAX_RX_BATCH;
+
+	if (g_seq_late < 1)
+		g_seq_late = 1;
+
+	if (g_seq_late > 31)		// the window is 32 frames
+		g_seq_late = 31;
+
+	if (g_radio_ttl < 10)
+		g_radio_ttl = 10;
+
+	if (g_slot_groups < 1)
+		g_slot_groups = 1;
+
+	if (g_slot_groups > MAX_SLOT_GROUPS)
+		g_slot_groups = MAX_SLOT_GROUPS;
+
+	if (g_subscription_minutes < 0)
+		g_subscription_minutes = 0;
+
+	if (g_group_idle_minutes < 0)
+		g_group_idle_minutes = 0;
+
+	g_tg_range_count = parse_ranges (g_talkgroups_allowed.c_str(), g_tg_ranges, MAX_TG_RANGES);
+
+	default_scanner ();		// no dmrd.conf
+
+#ifndef LINUX
+	g_pipeline = 0;
+	g_busy_poll = 0;
+	g_cpu = -1;
+	g_socket_filter = SOCKET_FILTER_OFF;
+	g_hugepages = 0;
+#endif
+
+	printf ("Config: debug %d, port %d, password %s, housekeeping minutes %d nodesize %d rx batch %d tx batch %d io %s shards %d fanout threads %d threshold %d pipeline %d tx threads %d busy poll %d/%dus cpu %d socket filter %s hugepages %d packet buffers %d seq filter %s/%d radio ttl %d slot groups %d subscription minutes %d static slots %d talkgroups %s (%d ranges) group idle minutes %d bridges %d scanners %d\n\n",
+				g_debug, g_udp_port, g_password, g_housekeeping_minutes, sizeof(node), g_rx_batch, g_tx_batch, g_io_backend == IO_BACKEND_URING ? "uring" : "socket", g_shard_count, g_fanout_threads, g_fanout_threshold, g_pipeline, g_tx_threads, g_busy_poll, g_busy_poll_us, g_cpu, g_socket_filter == SOCKET_FILTER_AUTH ? "auth" : g_socket_filter ? "shape" : "off", g_hugepages, g_packet_buffers, g_seq_filter == SEQ_FILTER_LATE ? "late" : g_seq_filter ? "dup" : "off", g_seq_late, g_radio_ttl, g_slot_groups, g_subscription_minutes, g_static_groups.size (), g_talkgroups_allowed.c_str(), g_tg_range_count, g_group_idle_minutes, g_bridge_count, g_scanner_count);
 
 }
 
@@ -1678,16 +6298,88 @@ int main(int argc, char **argv)
 	puts ("https://www.gnu.org/licenses\n");
 #endif
 
+	// object pools
+
+	g_node_pool.use_hugepages (g_hugepages != 0);
+	g_talkgroup_pool.use_hugepages (g_hugepages != 0);
+	g_subscription_pool.use_hugepages (g_hugepages != 0);
+	g_parrot_pool.use_hugepages (g_hugepages != 0);
+	g_fanout_job_pool.use_hugepages (g_hugepages != 0);
+
 	// make the talkgroups
 
-	g_scanner = findgroup (SCANNER_TG, true);
+	int k;
+
+	for (k=0; k < g_scanner_count; k++) {
+
+		talkgroup *sc = findgroup (g_scanner_defs[k].tg, true);
+
+		sc->bKeep = true;
+		sc->bScanner = true;
+
+		g_scanner_defs[k].g = sc;
+	}
 
 	for (int i=TAC_TG_START; i <= TAC_TG_END; i++) 
-		findgroup (i, true);
+		findgroup (i, true)->bKeep = true;
+
+	for (k=0; k < g_static_groups.capacity (); k++) {		// and the static ones
+
+		static_groups const &sg = g_static_groups.value (k);
+
+		for (int j=0; g_static_groups.key (k) && j < sg.count; j++) {
+
+			talkgroup *g = findgroup (sg.tg[j], true);
+
+			if (g)
+				g->bKeep = true;
+		}
+	}
+
+	for (k=0; k < g_bridge_count; k++) {		// and the bridged ones, linked around each bridge
+
+		bridge_def const &b = g_bridges[k];
+
+		talkgroup *first = NULL, *last = NULL;
+
+		for (int j=0; j < b.count; j++) {
+
+			talkgroup *g = findgroup (b.tg[j], true);
+
+			if (!g || g->link) {
+
+				printf ("Bridge %s: group %u is already bridged\n", b.name.c_str(), b.tg[j]);
+				continue;
+			}
+
+			g->bKeep = true;
+
+			if (!first)
+				first = g;
+
+			else
+				last->link = g;
+
+			g->floor = first;
+			last = g;
+		}
+
+		if (last != first)
+			last->link = first;
+
+		else if (first)
+			first->link = NULL;		// one group is no bridge
+	}
+
+	for (k=0; k < g_talkgroups.capacity (); k++) {		// scanners weren't all there when the first groups were made
+
+		if (g_talkgroups.key (k))
+			scanners_for (g_talkgroups.value (k));
+	}
 
-	// open the UDP port
+	// open the UDP port, a socket for each shard
 
-	if ((g_sock = open_udp(g_udp_port)) == -1) {
+	if (!open_shards ()) {
 
 		log (NULL, "Failed to open UDP port (%d)\n", GetInetError());
 		return 1;
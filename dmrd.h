@@ -39,6 +39,7 @@
 #include <iterator>
 #include <string>
 #include <map>
+#include <new>
 
 typedef unsigned char byte;
 typedef byte BYTE;
@@ -66,6 +67,16 @@ int pthread_create (pthread_t *, const pthread_attr_t *, PTHREADPROC, void *);
 #define GetInetError() ((int)GetLastError())
 #define SetInetError(E) (SetLastError(E))
 #define CLOSESOCKET closesocket
+#define THREADLOCAL __declspec(thread)
+
+// x86 doesn't reorder loads with loads or stores with stores, InterlockedExchange
+// keeps the compiler from moving the store
+
+#define ATOMIC_LOAD(P) (*(P))
+#define ATOMIC_STORE(P,V) InterlockedExchange ((LONG volatile *)(P), (LONG)(V))
+#define ATOMIC_ADD(P,V) (InterlockedExchangeAdd ((LONG volatile *)(P), (LONG)(V)) + (V))	// returns the new value
+#define ATOMIC_XCHG_PTR(P,V) InterlockedExchangePointer ((PVOID volatile *)(P), (PVOID)(V))		// returns the old value
+#define ATOMIC_CAS_PTR(P,OLD,NEW) (InterlockedCompareExchangePointer ((PVOID volatile *)(P), (PVOID)(NEW), (PVOID)(OLD)) == (PVOID)(OLD))
 
 #else	// linux
 
@@ -74,6 +85,7 @@ int pthread_create (pthread_t *, const pthread_attr_t *, PTHREADPROC, void *);
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <memory.h>
 #include <stdarg.h>
 #include <signal.h>
@@ -81,6 +93,61 @@ int pthread_create (pthread_t *, const pthread_attr_t *, PTHREADPROC, void *);
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+#ifndef BPF_MOD
+#define BPF_MOD 0x90
+#endif
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+#ifndef SO_ATTACH_BPF
+#define SO_ATTACH_BPF 50
+#endif
+
+#ifndef SO_MEMINFO
+#define SO_MEMINFO 55
+#endif
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT		// kernel headers new enough for multishot receive and buffer rings
+#define HAVE_IO_URING
+#endif
+#endif
+
+#if __has_include(<linux/bpf.h>)
+#include <linux/bpf.h>
+#ifdef __NR_bpf		// extended BPF socket filter with a map of authenticated addresses
+#define HAVE_EBPF
+#endif
+#endif
+#endif
 
 typedef unsigned long long u64;
 
@@ -91,6 +158,13 @@ dword GetTickCount();
 #define GetInetError() ((int)errno)
 #define SetInetError(E) (errno = (E))
 #define CLOSESOCKET close	 
+#define THREADLOCAL __thread
+
+#define ATOMIC_LOAD(P) __atomic_load_n ((P), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(P,V) __atomic_store_n ((P), (V), __ATOMIC_RELEASE)
+#define ATOMIC_ADD(P,V) __atomic_add_fetch ((P), (V), __ATOMIC_ACQ_REL)		// returns the new value
+#define ATOMIC_XCHG_PTR(P,V) __atomic_exchange_n ((P), (V), __ATOMIC_ACQ_REL)		// returns the old value
+#define ATOMIC_CAS_PTR(P,OLD,NEW) __sync_bool_compare_and_swap ((P), (OLD), (NEW))
 
 #define Sleep(MS)	do { \
 						if(MS) \
@@ -103,6 +177,26 @@ dword GetTickCount();
 
 #define inrange(V,L,H) ((V) >= (L) && (V) <= (H))
 
+// monotonic microseconds, for latency counters
+
+inline u64 GetMicroseconds ()
+{
+#ifdef WIN32
+	LARGE_INTEGER f, c;
+
+	QueryPerformanceFrequency (&f);
+	QueryPerformanceCounter (&c);
+
+	return (u64) (c.QuadPart / (f.QuadPart / 1000000));
+#else
+	timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+
+	return (u64) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+#endif
+}
+
 #ifdef WIN32
 #define eq(A,B) (stricmp((A),(B))==0)
 #else
@@ -110,7 +204,7 @@ dword GetTickCount();
 #endif 
 
 void init_process();
-int open_udp (int port);
+int open_udp (int port, bool bReusePort=false);
 bool IsOptionPresent (int argc, char **argv, PCSTR arg);
 byte * make_sha256_hash (void const *pSrc, int nSize, byte *dest, void const *pSalt, int nSaltSize);
 bool select_rx (int sock, int wait_secs);
@@ -302,6 +396,1601 @@ public:
 
 };
 
+// Event loop for sockets and timers. On Linux everything is an fd watched by epoll and
+// timers are timerfds, elsewhere sockets are watched by select() and timers are kept
+// in milliseconds from GetTickCount().
+
+typedef void (*REACTORPROC) (void *cookie);
+
+struct reactor_event
+{
+	int				fd;				// socket or timerfd, -1 when removed
+	REACTORPROC		proc;
+	void			*cookie;
+	bool			bTimer;
+	bool			bArmed;
+	dword			interval;		// timer repeat interval (ms), 0 = one shot
+	dword			due;			// GetTickCount() when timer fires (select only)
+	reactor_event	*next;
+};
+
+class reactor
+{
+	reactor_event	*m_pEvents;
+	int				m_epoll;
+
+public:
+
+	reactor() {
+
+		m_pEvents = NULL;
+		m_epoll = -1;
+	}
+
+	bool init() {
+
+#ifdef LINUX
+		m_epoll = epoll_create (64);
+
+		return m_epoll != -1;
+#else
+		return true;
+#endif
+	}
+
+	reactor_event * add_socket (int fd, REACTORPROC proc, void *cookie) {
+
+		reactor_event *e = new_event (fd, proc, cookie, false);
+
+#ifdef LINUX
+		epoll_event ev;
+
+		memset (&ev, 0, sizeof(ev));
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = e;
+
+		if (epoll_ctl (m_epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+
+			e->fd = -1;
+			return NULL;
+		}
+#endif
+		return e;
+	}
+
+	// timer starts disarmed, use set_timer() to start it
+
+	reactor_event * add_timer (REACTORPROC proc, void *cookie) {
+
+		int fd = 0;
+
+#ifdef LINUX
+		fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+		if (fd == -1)
+			return NULL;
+#endif
+
+		reactor_event *e = new_event (fd, proc, cookie, true);
+
+#ifdef LINUX
+		epoll_event ev;
+
+		memset (&ev, 0, sizeof(ev));
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = e;
+
+		if (epoll_ctl (m_epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+
+			close (fd);
+			e->fd = -1;
+			return NULL;
+		}
+#endif
+		return e;
+	}
+
+	// fire after first_ms, then every interval_ms if not 0. first_ms of 0 disarms.
+
+	void set_timer (reactor_event *e, dword first_ms, dword interval_ms=0) {
+
+		e->interval = interval_ms;
+		e->bArmed = first_ms != 0;
+
+#ifdef LINUX
+		itimerspec t;
+
+		t.it_value.tv_sec = first_ms / 1000;
+		t.it_value.tv_nsec = (first_ms % 1000) * 1000000;
+		t.it_interval.tv_sec = interval_ms / 1000;
+		t.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+
+		timerfd_settime (e->fd, 0, &t, NULL);
+#else
+		e->due = GetTickCount() + first_ms;
+#endif
+	}
+
+	bool is_armed (reactor_event const *e) const {
+
+		return e->bArmed;
+	}
+
+	// events are only marked here, they are freed by wait() so a handler can remove
+	// an event that is still pending in the same wait
+
+	void remove (reactor_event *e) {
+
+		if (e->fd != -1) {
+
+#ifdef LINUX
+			epoll_ctl (m_epoll, EPOLL_CTL_DEL, e->fd, NULL);
+
+			if (e->bTimer)
+				close (e->fd);
+#endif
+			e->fd = -1;
+			e->bArmed = false;
+		}
+	}
+
+	// wait up to timeout_ms (-1 = forever) and dispatch whatever is ready
+
+	void wait (int timeout_ms) {
+
+#ifdef LINUX
+		epoll_event evs[32];
+
+		int n = epoll_wait (m_epoll, evs, 32, timeout_ms);
+
+		for (int i=0; i < n; i++) {
+
+			reactor_event *e = (reactor_event*) evs[i].data.ptr;
+
+			if (e->fd == -1)
+				continue;
+
+			if (e->bTimer) {
+
+				u64 expirations;
+
+				if (read (e->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+					continue;		// disarmed or re-armed since epoll_wait()
+
+				if (!e->interval)
+					e->bArmed = false;
+			}
+
+			e->proc (e->cookie);
+		}
+#else
+		fd_set read;
+
+		FD_ZERO (&read);
+
+		int maxfd = 0;
+
+		dword now = GetTickCount();
+
+		reactor_event *e;
+
+		for (e = m_pEvents; e; e = e->next) {
+
+			if (e->fd == -1)
+				continue;
+
+			if (e->bTimer) {
+
+				if (e->bArmed) {
+
+					int left = (int) (e->due - now);
+
+					if (left < 0)
+						left = 0;
+
+					if (timeout_ms < 0 || left < timeout_ms)
+						timeout_ms = left;
+				}
+			}
+
+			else {
+
+				FD_SET (e->fd, &read);
+
+				if (e->fd > maxfd)
+					maxfd = e->fd;
+			}
+		}
+
+		timeval t;
+
+		t.tv_sec = timeout_ms / 1000;
+		t.tv_usec = (timeout_ms % 1000) * 1000;
+
+		int ret = select (maxfd + 1, &read, NULL, NULL, timeout_ms < 0 ? NULL : &t);
+
+		for (e = m_pEvents; ret > 0 && e; e = e->next) {
+
+			if (e->fd != -1 && !e->bTimer && FD_ISSET(e->fd, &read))
+				e->proc (e->cookie);
+		}
+
+		now = GetTickCount();
+
+		for (e = m_pEvents; e; e = e->next) {
+
+			if (e->fd != -1 && e->bTimer && e->bArmed && (int) (now - e->due) >= 0) {
+
+				if (e->interval)
+					e->due += e->interval;
+				else
+					e->bArmed = false;
+
+				e->proc (e->cookie);
+			}
+		}
+#endif
+
+		purge ();
+	}
+
+private:
+
+	reactor_event * new_event (int fd, REACTORPROC proc, void *cookie, bool bTimer) {
+
+		reactor_event *e = new reactor_event;
+
+		memset (e, 0, sizeof(*e));
+
+		e->fd = fd;
+		e->proc = proc;
+		e->cookie = cookie;
+		e->bTimer = bTimer;
+		e->next = m_pEvents;
+
+		m_pEvents = e;
+
+		return e;
+	}
+
+	void purge () {
+
+		reactor_event **pp = &m_pEvents;
+
+		while (*pp) {
+
+			reactor_event *e = *pp;
+
+			if (e->fd == -1) {
+
+				*pp = e->next;
+				delete e;
+			}
+
+			else
+				pp = &e->next;
+		}
+	}
+};
+
+class mutex
+{
+#ifdef WIN32
+	CRITICAL_SECTION	m_cs;
+#else
+	pthread_mutex_t		m_mutex;
+#endif
+
+public:
+
+	mutex() {
+
+#ifdef WIN32
+		InitializeCriticalSection (&m_cs);
+#else
+		pthread_mutex_init (&m_mutex, NULL);
+#endif
+	}
+
+	~mutex() {
+
+#ifdef WIN32
+		DeleteCriticalSection (&m_cs);
+#else
+		pthread_mutex_destroy (&m_mutex);
+#endif
+	}
+
+	void lock() {
+
+#ifdef WIN32
+		EnterCriticalSection (&m_cs);
+#else
+		pthread_mutex_lock (&m_mutex);
+#endif
+	}
+
+	void unlock() {
+
+#ifdef WIN32
+		LeaveCriticalSection (&m_cs);
+#else
+		pthread_mutex_unlock (&m_mutex);
+#endif
+	}
+};
+
+class semaphore
+{
+#ifdef WIN32
+	HANDLE				m_sem;
+#else
+	sem_t				m_sem;
+#endif
+
+public:
+
+	semaphore() {
+
+#ifdef WIN32
+		m_sem = CreateSemaphore (NULL, 0, 0x7FFFFFFF, NULL);
+#else
+		sem_init (&m_sem, 0, 0);
+#endif
+	}
+
+	~semaphore() {
+
+#ifdef WIN32
+		CloseHandle (m_sem);
+#else
+		sem_destroy (&m_sem);
+#endif
+	}
+
+	void post (int n=1) {
+
+#ifdef WIN32
+		ReleaseSemaphore (m_sem, n, NULL);
+#else
+		while (n--)
+			sem_post (&m_sem);
+#endif
+	}
+
+	void wait () {
+
+#ifdef WIN32
+		WaitForSingleObject (m_sem, INFINITE);
+#else
+		while (sem_wait (&m_sem) == -1 && errno == EINTR)
+			;
+#endif
+	}
+};
+
+// Lock-free queue between exactly one producer thread and one consumer thread.
+// The producer fills slots from reserve() (or space() and fill()) and publishes them with
+// commit(), the consumer reads avail() slots with at() and gives them back with consume(),
+// so items can be used in place until then. Size must be a power of 2.
+// The two indexes are on their own cache lines, and each side keeps a copy of the other
+// side's index so it only touches the other line when it looks full or empty.
+
+#define CACHE_LINE 64
+
+template <class T> class spsc_ring
+{
+	T					*m_pItems;
+	dword				m_nMask;
+	char				m_pad0[CACHE_LINE];
+
+	dword volatile		m_nHead;		// next slot to fill, written by the producer
+	dword				m_nTailSeen;	// producer's copy of m_nTail
+	char				m_pad1[CACHE_LINE];
+
+	dword volatile		m_nTail;		// next slot to read, written by the consumer
+	dword				m_nHeadSeen;	// consumer's copy of m_nHead
+	char				m_pad2[CACHE_LINE];
+
+public:
+
+	spsc_ring() {
+
+		m_pItems = NULL;
+		m_nMask = 0;
+		m_nHead = m_nTail = 0;
+		m_nTailSeen = m_nHeadSeen = 0;
+	}
+
+	~spsc_ring() {
+
+		delete [] m_pItems;
+	}
+
+	void init (int nSize) {
+
+		delete [] m_pItems;
+
+		m_pItems = new T[nSize];
+		m_nMask = nSize - 1;
+		m_nHead = m_nTail = 0;
+		m_nTailSeen = m_nHeadSeen = 0;
+	}
+
+	int size () const {
+
+		return (int) m_nMask + 1;
+	}
+
+	// producer
+
+	int space (int want=1) {	// free slots, at least want if there are that many
+
+		if ((int) (m_nMask + 1 - (m_nHead - m_nTailSeen)) < want)
+			m_nTailSeen = ATOMIC_LOAD(&m_nTail);
+
+		return (int) (m_nMask + 1 - (m_nHead - m_nTailSeen));
+	}
+
+	T & fill (int i) {		// i < space()
+
+		return m_pItems[(m_nHead + i) & m_nMask];
+	}
+
+	T * reserve () {
+
+		return space() ? &fill(0) : NULL;
+	}
+
+	void commit (int n=1) {
+
+		ATOMIC_STORE (&m_nHead, m_nHead + n);
+	}
+
+	// consumer
+
+	int avail () {
+
+		if (m_nHeadSeen == m_nTail)
+			m_nHeadSeen = ATOMIC_LOAD(&m_nHead);
+
+		return (int) (m_nHeadSeen - m_nTail);
+	}
+
+	T & at (int i) {
+
+		return m_pItems[(m_nTail + i) & m_nMask];
+	}
+
+	void consume (int n) {
+
+		ATOMIC_STORE (&m_nTail, m_nTail + n);
+	}
+};
+
+// Open addressing hash table keyed by a non-zero dword (0 marks an empty slot).
+// Keys are kept apart from the values so a probe only walks the dense key array.
+// Linear probing, doubles at 3/4 full, and remove() shifts the rest of the run back
+// instead of leaving tombstones, so lookups never get slower as entries come and go.
+// Iterate with capacity(), key() and value(). Not thread safe.
+
+template <class T> class dword_map
+{
+	dword				*m_pKeys;
+	T					*m_pValues;
+	dword				m_nMask;
+	int					m_nShift;		// 32 - log2(capacity), multiplicative hash takes the top bits
+	int					m_nCount;
+
+	dword slot_of (dword key) const {
+
+		return (dword) (key * 2654435769U) >> m_nShift & m_nMask;
+	}
+
+	void grow () {
+
+		dword *pOldKeys = m_pKeys;
+		T *pOldValues = m_pValues;
+		int nOld = m_pKeys ? (int) m_nMask + 1 : 0;
+		int nSize = nOld ? nOld * 2 : 16;
+
+		m_pKeys = new dword[nSize];
+		m_pValues = new T[nSize];
+		m_nMask = nSize - 1;
+
+		memset (m_pKeys, 0, nSize * sizeof(dword));
+
+		for (m_nShift = 32; nSize > 1; nSize >>= 1)
+			m_nShift --;
+
+		for (int i=0; i < nOld; i++) {
+
+			if (pOldKeys[i]) {
+
+				dword j = slot_of (pOldKeys[i]);
+
+				while (m_pKeys[j])
+					j = (j + 1) & m_nMask;
+
+				m_pKeys[j] = pOldKeys[i];
+				m_pValues[j] = pOldValues[i];
+			}
+		}
+
+		delete [] pOldKeys;
+		delete [] pOldValues;
+	}
+
+public:
+
+	dword_map() {
+
+		m_pKeys = NULL;
+		m_pValues = NULL;
+		m_nMask = 0;
+		m_nShift = 32;
+		m_nCount = 0;
+	}
+
+	~dword_map() {
+
+		delete [] m_pKeys;
+		delete [] m_pValues;
+	}
+
+	int size () const {
+
+		return m_nCount;
+	}
+
+	int capacity () const {
+
+		return m_pKeys ? (int) m_nMask + 1 : 0;
+	}
+
+	dword key (int i) const {		// 0 if slot i is empty
+
+		return m_pKeys[i];
+	}
+
+	T & value (int i) {
+
+		return m_pValues[i];
+	}
+
+	T * find (dword key) const {
+
+		if (!m_nCount)
+			return NULL;
+
+		for (dword j = slot_of (key); m_pKeys[j]; j = (j + 1) & m_nMask) {
+
+			if (m_pKeys[j] == key)
+				return &m_pValues[j];
+		}
+
+		return NULL;
+	}
+
+	T & insert (dword key, bool *pbNew=NULL) {		// existing value, or a new one set to T()
+
+		if (!m_pKeys || (m_nCount + 1) * 4 > (int) (m_nMask + 1) * 3)
+			grow ();
+
+		dword j = slot_of (key);
+
+		for (; m_pKeys[j]; j = (j + 1) & m_nMask) {
+
+			if (m_pKeys[j] == key) {
+
+				if (pbNew)
+					*pbNew = false;
+
+				return m_pValues[j];
+			}
+		}
+
+		if (pbNew)
+			*pbNew = true;
+
+		m_nCount ++;
+
+		m_pKeys[j] = key;
+		m_pValues[j] = T();
+
+		return m_pValues[j];
+	}
+
+	bool remove (dword key) {
+
+		if (!m_nCount)
+			return false;
+
+		dword j = slot_of (key);
+
+		for (; m_pKeys[j] != key; j = (j + 1) & m_nMask) {
+
+			if (!m_pKeys[j])
+				return false;
+		}
+
+		m_nCount --;
+
+		// pull back any later entry in the run that would no longer be found past the hole
+
+		for (dword k = (j + 1) & m_nMask; m_pKeys[k]; k = (k + 1) & m_nMask) {
+
+			dword home = slot_of (m_pKeys[k]);
+
+			if (((k - home) & m_nMask) >= ((k - j) & m_nMask)) {
+
+				m_pKeys[j] = m_pKeys[k];
+				m_pValues[j] = m_pValues[k];
+
+				j = k;
+			}
+		}
+
+		m_pKeys[j] = 0;
+		m_pValues[j] = T();
+
+		return true;
+	}
+};
+
+// Set of 24-bit IDs, a bitmap cut into pages of 4096 IDs that are only allocated when
+// they are partly set. Whole pages that are all set share one static page of ones, so a
+// few ranges, or everything, take little more than the page table. Not thread safe.
+
+#define ID_PAGE_BITS 12
+#define ID_PAGES (1 << (24 - ID_PAGE_BITS))
+#define ID_PAGE_DWORDS ((1 << ID_PAGE_BITS) / 32)
+
+class id_bitmap
+{
+	dword				*m_pPages[ID_PAGES];	// NULL when none of the page is set
+
+	static dword * full () {
+
+		static dword page[ID_PAGE_DWORDS];
+
+		if (!page[0])
+			memset (page, 0xFF, sizeof(page));
+
+		return page;
+	}
+
+	void drop (int p) {
+
+		if (m_pPages[p] != full ())
+			delete [] m_pPages[p];
+
+		m_pPages[p] = NULL;
+	}
+
+	dword * own (int p) {		// a page of our own to change bits in
+
+		if (!m_pPages[p] || m_pPages[p] == full ()) {
+
+			dword *page = new dword[ID_PAGE_DWORDS];
+
+			memset (page, m_pPages[p] ? 0xFF : 0, ID_PAGE_DWORDS * sizeof(dword));
+
+			m_pPages[p] = page;
+		}
+
+		return m_pPages[p];
+	}
+
+public:
+
+	id_bitmap() {
+
+		memset (m_pPages, 0, sizeof(m_pPages));
+	}
+
+	~id_bitmap() {
+
+		for (int p=0; p < ID_PAGES; p++)
+			drop (p);
+	}
+
+	void set (dword low, dword high, bool bOn) {		// low..high inclusive, both below 2^24
+
+		while (low <= high) {
+
+			int p = low >> ID_PAGE_BITS;
+
+			dword first = (dword) p << ID_PAGE_BITS;
+			dword last = first + (1 << ID_PAGE_BITS) - 1;
+
+			if (low == first && high >= last) {		// all of the page
+
+				drop (p);
+
+				if (bOn)
+					m_pPages[p] = full ();
+			}
+
+			else if (bOn || m_pPages[p]) {
+
+				dword *page = own (p);
+
+				for (dword i = low; i <= high && i <= last; i++) {
+
+					if (bOn)
+						page[(i - first) >> 5] |= (dword) 1 << (i & 31);
+
+					else
+						page[(i - first) >> 5] &= ~((dword) 1 << (i & 31));
+				}
+			}
+
+			if (high <= last)
+				break;
+
+			low = last + 1;
+		}
+	}
+
+	bool test (dword id) const {
+
+		dword const *page = m_pPages[(id >> ID_PAGE_BITS) & (ID_PAGES - 1)];
+
+		return page && (page[(id >> 5) & (ID_PAGE_DWORDS - 1)] >> (id & 31) & 1) != 0;
+	}
+
+	int pages () const {		// allocated, the shared page of ones not counted
+
+		int n = 0;
+
+		for (int p=0; p < ID_PAGES; p++) {
+
+			if (m_pPages[p] && m_pPages[p] != full ())
+				n ++;
+		}
+
+		return n;
+	}
+};
+
+// Hierarchical timing wheel, the classic BSD/Linux kernel timer layout. Level 0 has a
+// slot for each of the next 256 ticks and each higher level has 64 slots, each of them
+// covering the whole of the level below, so 4 levels reach 2^26 ticks. schedule() and
+// cancel() are O(1). advance() runs the timers in one level 0 slot per tick, and every
+// 256 ticks moves the next slot of the level above down, a few timers at a time.
+// Timers further out than the wheel reaches fire at its far end. Not thread safe.
+
+#define WHEEL_LEVELS 4
+#define WHEEL_L0_BITS 8
+#define WHEEL_LN_BITS 6
+
+struct wheel_timer
+{
+	wheel_timer		*next, *prev;		// slot list, next is NULL when not scheduled
+	dword			due;				// tick it fires on
+	REACTORPROC		proc;
+	void			*cookie;
+
+	wheel_timer() {
+
+		next = prev = NULL;
+		due = 0;
+		proc = NULL;
+		cookie = NULL;
+	}
+};
+
+class timer_wheel
+{
+	wheel_timer		m_slots[(1 << WHEEL_L0_BITS) + (WHEEL_LEVELS - 1) * (1 << WHEEL_LN_BITS)];	// list heads
+	dword			m_nNow;				// next tick advance() runs
+	int				m_nCount;
+
+	wheel_timer * head (int level, dword ix) {
+
+		if (!level)
+			return &m_slots[ix & ((1 << WHEEL_L0_BITS) - 1)];
+
+		return &m_slots[(1 << WHEEL_L0_BITS) + (level - 1) * (1 << WHEEL_LN_BITS) + (ix & ((1 << WHEEL_LN_BITS) - 1))];
+	}
+
+	static void unlink (wheel_timer *t) {
+
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		t->next = t->prev = NULL;
+	}
+
+	static void append (wheel_timer *h, wheel_timer *t) {
+
+		t->prev = h->prev;
+		t->next = h;
+		h->prev->next = t;
+		h->prev = t;
+	}
+
+	static void splice (wheel_timer *from, wheel_timer *to) {	// move the whole list, to is empty
+
+		to->next = to->prev = to;
+
+		if (from->next != from) {
+
+			to->next = from->next;
+			to->prev = from->prev;
+			to->next->prev = to;
+			to->prev->next = to;
+
+			from->next = from->prev = from;
+		}
+	}
+
+	void link (wheel_timer *t) {
+
+		dword delta = t->due - m_nNow;
+
+		if ((int) delta < 0) {		// overdue, next tick
+
+			append (head (0, m_nNow), t);
+			return;
+		}
+
+		if (delta < (1 << WHEEL_L0_BITS)) {
+
+			append (head (0, t->due), t);
+			return;
+		}
+
+		int level = 1, shift = WHEEL_L0_BITS;
+
+		while (level < WHEEL_LEVELS - 1 && delta >= (dword) 1 << (shift + WHEEL_LN_BITS)) {
+
+			level ++;
+			shift += WHEEL_LN_BITS;
+		}
+
+		if (delta >= (dword) 1 << (shift + WHEEL_LN_BITS))
+			t->due = m_nNow + ((dword) 1 << (shift + WHEEL_LN_BITS)) - 1;
+
+		append (head (level, t->due >> shift), t);
+	}
+
+	void cascade (int level, dword ix) {
+
+		wheel_timer list;
+
+		splice (head (level, ix), &list);
+
+		while (list.next != &list) {
+
+			wheel_timer *t = list.next;
+
+			unlink (t);
+			link (t);
+		}
+	}
+
+public:
+
+	timer_wheel() {
+
+		for (int i=0; i < (int) (sizeof(m_slots) / sizeof(m_slots[0])); i++)
+			m_slots[i].next = m_slots[i].prev = &m_slots[i];
+
+		m_nNow = 0;
+		m_nCount = 0;
+	}
+
+	int count () const {
+
+		return m_nCount;
+	}
+
+	dword now () const {
+
+		return m_nNow;
+	}
+
+	void reset (dword now) {	// restart the clock, only when nothing is scheduled
+
+		if (!m_nCount)
+			m_nNow = now;
+	}
+
+	bool pending (wheel_timer const *t) const {
+
+		return t->next != NULL;
+	}
+
+	void schedule (wheel_timer *t, dword due) {
+
+		if (t->next)
+			unlink (t);
+		else
+			m_nCount ++;
+
+		t->due = due;
+
+		link (t);
+	}
+
+	void cancel (wheel_timer *t) {
+
+		if (t->next) {
+
+			unlink (t);
+			m_nCount --;
+		}
+	}
+
+	// run everything due up to and including tick now, returns the number run
+
+	int advance (dword now) {
+
+		int fired = 0;
+
+		while ((int) (now - m_nNow) >= 0) {
+
+			if (!(m_nNow & ((1 << WHEEL_L0_BITS) - 1))) {
+
+				for (int level=1, shift=WHEEL_L0_BITS; level < WHEEL_LEVELS; level++, shift += WHEEL_LN_BITS) {
+
+					dword ix = (m_nNow >> shift) & ((1 << WHEEL_LN_BITS) - 1);
+
+					cascade (level, ix);
+
+					if (ix)		// the level above only turns when this one wraps
+						break;
+				}
+			}
+
+			wheel_timer list;
+
+			splice (head (0, m_nNow), &list);
+
+			m_nNow ++;		// anything rescheduled for now from a handler goes in the next tick
+
+			while (list.next != &list) {
+
+				wheel_timer *t = list.next;
+
+				unlink (t);
+
+				m_nCount --;
+
+				t->proc (t->cookie);
+
+				fired ++;
+			}
+		}
+
+		return fired;
+	}
+};
+
+// Fixed size object pool. Objects are carved out of slabs (2 MB hugepages when asked
+// for and the system has some, else SLAB_SIZE from malloc), freed objects go on a free
+// list and are handed out again first, and slabs are never given back. Once the pool
+// has grown to the working set, alloc() and free() don't go near the heap.
+// Not thread safe, callers lock.
+
+#define SLAB_SIZE 65536
+#define HUGE_SLAB_SIZE (2 * 1024 * 1024)
+
+struct slab_stats
+{
+	dword			slabs;
+	dword			huge;				// slabs that are hugepages
+	dword			capacity;			// objects in all slabs
+	dword			used;
+	dword			peak;
+	dword			allocs;
+	dword			failed;
+
+	slab_stats() {
+
+		memset (this, 0, sizeof(*this));
+	}
+};
+
+template <class T> class slab_pool
+{
+	union item {
+
+		item		*next;				// while free
+		char		data[sizeof(T)];
+		double		align_d;
+		u64			align_u;
+	};
+
+	item			*m_pFree;
+	bool			m_bHuge;
+	slab_stats		m_stats;
+
+	bool grow () {
+
+		void *slab = NULL;
+		int size = SLAB_SIZE;
+
+#ifdef LINUX
+		if (m_bHuge) {
+
+			slab = mmap (NULL, HUGE_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+			if (slab == MAP_FAILED) {
+
+				slab = NULL;
+				m_bHuge = false;		// none reserved, don't keep asking
+			}
+
+			else {
+
+				size = HUGE_SLAB_SIZE;
+				m_stats.huge ++;
+			}
+		}
+#endif
+
+		if (!slab)
+			slab = malloc (size);
+
+		if (!slab)
+			return false;
+
+		int count = size / sizeof(item);
+
+		item *p = (item*) slab;
+
+		for (int i=0; i < count; i++) {
+
+			p[i].next = m_pFree;
+			m_pFree = &p[i];
+		}
+
+		m_stats.slabs ++;
+		m_stats.capacity += count;
+
+		return true;
+	}
+
+public:
+
+	slab_pool() {
+
+		m_pFree = NULL;
+		m_bHuge = false;
+	}
+
+	void use_hugepages (bool bHuge) {		// for slabs from now on
+
+		m_bHuge = bHuge;
+	}
+
+	T * alloc () {
+
+		if (!m_pFree && !grow ()) {
+
+			m_stats.failed ++;
+			return NULL;
+		}
+
+		item *p = m_pFree;
+
+		m_pFree = p->next;
+
+		m_stats.allocs ++;
+
+		if (++m_stats.used > m_stats.peak)
+			m_stats.peak = m_stats.used;
+
+		return new (p) T;
+	}
+
+	void free (T *p) {
+
+		if (p) {
+
+			p->~T();
+
+			item *i = (item*) p;
+
+			i->next = m_pFree;
+			m_pFree = i;
+
+			m_stats.used --;
+		}
+	}
+
+	slab_stats const & stats () const {
+
+		return m_stats;
+	}
+};
+
+// Refcounted packet buffers. Received datagrams land in them, and anything that has to
+// keep a datagram after it's been routed (another shard's queue, a TX thread, an
+// io_uring send, a fan-out job, a parrot recording) takes a reference instead of a copy.
+// Each routing thread has its own pool and only it allocates, so the free list needs no
+// lock. The last reference can be dropped on any thread, those buffers go on a lock-free
+// stack the owner takes back with one exchange when its free list runs dry. The owner
+// keeps a reserve for its receive slots and refuses references that would eat into it,
+// the caller then does without, the way it would if the pool didn't exist.
+
+#define PKT_BUFSIZE 1024
+#define PKT_CONSUMERS 8					// counters per consumer, the ids are up to the caller
+
+class pkt_pool;
+
+struct pkt_buf
+{
+	long volatile	refs;
+	int				size;
+	pkt_pool		*pool;				// NULL for a scratch buffer that can't be shared
+	pkt_buf			*next;				// while free
+	byte			data[PKT_BUFSIZE];
+
+	pkt_buf() {
+
+		refs = 1;
+		size = 0;
+		pool = NULL;
+		next = NULL;
+	}
+};
+
+struct pkt_stats
+{
+	dword			capacity;
+	dword			reserve;
+	dword			low;				// fewest free buffers seen
+	dword			allocs;
+	dword			failed;				// allocations with nothing free
+	dword			holds[PKT_CONSUMERS];		// references taken through this pool
+	dword			refused[PKT_CONSUMERS];		// references refused, pool down to its reserve
+	long volatile	releases[PKT_CONSUMERS];	// references dropped on buffers of this pool, any thread
+
+	pkt_stats() {
+
+		memset (this, 0, sizeof(*this));
+	}
+};
+
+class pkt_pool
+{
+	pkt_buf			*m_pBufs;
+	pkt_buf			*m_pFree;
+	int				m_nFree;
+	pkt_buf * volatile m_pRemote;		// released on other threads
+	pkt_stats		m_stats;
+
+	void take_remote () {
+
+		pkt_buf *p = (pkt_buf*) ATOMIC_XCHG_PTR (&m_pRemote, (pkt_buf*) NULL);
+
+		while (p) {
+
+			pkt_buf *next = p->next;
+
+			p->next = m_pFree;
+			m_pFree = p;
+			m_nFree ++;
+
+			p = next;
+		}
+	}
+
+	void put_remote (pkt_buf *p) {
+
+		pkt_buf *head;
+
+		do {
+
+			head = m_pRemote;
+			p->next = head;
+
+		} while (!ATOMIC_CAS_PTR (&m_pRemote, head, p));
+	}
+
+	// enough free to give one away, outside the reserve unless bReserve
+
+	bool have (bool bReserve) {
+
+		int need = bReserve ? 0 : (int) m_stats.reserve;
+
+		if (m_nFree <= need)
+			take_remote ();
+
+		return m_nFree > need;
+	}
+
+public:
+
+	pkt_pool() {
+
+		m_pBufs = NULL;
+		m_pFree = NULL;
+		m_nFree = 0;
+		m_pRemote = NULL;
+	}
+
+	void init (int count, int reserve) {
+
+		m_pBufs = new pkt_buf[count];
+
+		for (int i=0; i < count; i++) {
+
+			m_pBufs[i].pool = this;
+			m_pBufs[i].refs = 0;
+			m_pBufs[i].next = m_pFree;
+
+			m_pFree = &m_pBufs[i];
+		}
+
+		m_nFree = count;
+
+		m_stats.capacity = count;
+		m_stats.reserve = reserve;
+		m_stats.low = count;
+	}
+
+	// a buffer with one reference for the caller, owner only. Only the receive path
+	// should dip into the reserve
+
+	pkt_buf * alloc (bool bReserve = false) {
+
+		if (!have (bReserve)) {
+
+			m_stats.failed ++;
+			return NULL;
+		}
+
+		pkt_buf *p = m_pFree;
+
+		m_pFree = p->next;
+
+		if ((dword) --m_nFree < m_stats.low)
+			m_stats.low = m_nFree;
+
+		p->refs = 1;
+		p->size = 0;
+
+		m_stats.allocs ++;
+
+		return p;
+	}
+
+	// another reference for a buffer the caller already has one on. On the owner's own
+	// buffers this is refused when the pool is down to its reserve, somebody has to give
+	// a receive slot a new buffer for each one kept
+
+	bool hold (pkt_buf *p, int consumer) {
+
+		if (!p->pool || (p->pool == this && !have (false))) {
+
+			m_stats.refused[consumer] ++;
+			return false;
+		}
+
+		ATOMIC_ADD (&p->refs, 1);
+
+		m_stats.holds[consumer] ++;
+
+		return true;
+	}
+
+	// drop a reference, on any thread. The buffer mustn't be touched after
+
+	static void release (pkt_buf *p, int consumer) {
+
+		pkt_pool *pool = p->pool;
+
+		if (!pool)
+			return;
+
+		ATOMIC_ADD (&pool->m_stats.releases[consumer], 1);
+
+		if (ATOMIC_ADD (&p->refs, -1) == 0)
+			pool->put_remote (p);
+	}
+
+	// the same on the owner's thread, straight back on the free list if it was the last
+
+	void release_local (pkt_buf *p, int consumer) {
+
+		if (p->pool == this && ATOMIC_LOAD (&p->refs) == 1) {
+
+			ATOMIC_ADD (&m_stats.releases[consumer], 1);
+
+			p->refs = 0;
+			p->next = m_pFree;
+
+			m_pFree = p;
+			m_nFree ++;
+		}
+
+		else
+			release (p, consumer);
+	}
+
+	bool shared (pkt_buf const *p) const {		// somebody else has a reference
+
+		return ATOMIC_LOAD (&p->refs) > 1;
+	}
+
+	int free_count () const {		// on the owner's list, not counting those waiting to come back
+
+		return m_nFree;
+	}
+
+	pkt_stats const & stats () const {
+
+		return m_stats;
+	}
+};
+
+#ifdef HAVE_IO_URING
+
+// Minimal io_uring wrapper using the raw system calls (no liburing).
+// One submission/completion ring, and optionally a ring of provided buffers
+// that the kernel fills for IOSQE_BUFFER_SELECT receives.
+
+class uring
+{
+	int					m_fd;
+	unsigned			*m_sq_khead, *m_sq_ktail, *m_sq_array;
+	unsigned			*m_cq_khead, *m_cq_ktail;
+	unsigned			m_sq_mask, m_cq_mask, m_sq_entries;
+	unsigned			m_sq_tail;			// our tail, published by submit()
+	io_uring_sqe		*m_sqes;
+	io_uring_cqe		*m_cqes;
+	void				*m_sq_ptr, *m_cq_ptr;
+	size_t				m_sq_size, m_cq_size;
+
+	io_uring_buf_ring	*m_br;				// provided buffers
+	byte				*m_bufs;
+	unsigned			m_br_mask;
+	unsigned short		m_br_tail;
+	int					m_bufsize;
+
+public:
+
+	uring() {
+
+		m_fd = -1;
+		m_sq_entries = 0;
+		m_sq_ptr = m_cq_ptr = NULL;
+		m_sqes = NULL;
+		m_br = NULL;
+		m_bufs = NULL;
+	}
+
+	~uring() {
+
+		close_();
+	}
+
+	int fd() const {return m_fd;}
+
+	bool init (unsigned entries, unsigned cq_entries) {
+
+		io_uring_params p;
+
+		memset (&p, 0, sizeof(p));
+
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = cq_entries;
+
+		m_fd = (int) syscall (__NR_io_uring_setup, entries, &p);
+
+		if (m_fd == -1)
+			return false;
+
+		m_sq_entries = p.sq_entries;
+
+		m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+		bool bSingle = !!(p.features & IORING_FEAT_SINGLE_MMAP);
+
+		if (bSingle && m_cq_size > m_sq_size)
+			m_sq_size = m_cq_size;
+
+		m_sq_ptr = mmap (NULL, m_sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+
+		if (m_sq_ptr == MAP_FAILED) {
+
+			m_sq_ptr = NULL;
+			close_();
+			return false;
+		}
+
+		if (bSingle) {
+
+			m_cq_ptr = m_sq_ptr;
+		}
+
+		else {
+
+			m_cq_ptr = mmap (NULL, m_cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+
+			if (m_cq_ptr == MAP_FAILED) {
+
+				m_cq_ptr = NULL;
+				close_();
+				return false;
+			}
+		}
+
+		m_sqes = (io_uring_sqe*) mmap (NULL, p.sq_entries * sizeof(io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQES);
+
+		if (m_sqes == MAP_FAILED) {
+
+			m_sqes = NULL;
+			close_();
+			return false;
+		}
+
+		byte *sq = (byte*) m_sq_ptr;
+		byte *cq = (byte*) m_cq_ptr;
+
+		m_sq_khead = (unsigned*) (sq + p.sq_off.head);
+		m_sq_ktail = (unsigned*) (sq + p.sq_off.tail);
+		m_sq_array = (unsigned*) (sq + p.sq_off.array);
+		m_sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+		m_sq_tail = *m_sq_ktail;
+
+		m_cq_khead = (unsigned*) (cq + p.cq_off.head);
+		m_cq_ktail = (unsigned*) (cq + p.cq_off.tail);
+		m_cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+		m_cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+
+		return true;
+	}
+
+	void close_() {
+
+		if (m_sqes)
+			munmap (m_sqes, m_sq_entries * sizeof(io_uring_sqe));
+
+		if (m_cq_ptr && m_cq_ptr != m_sq_ptr)
+			munmap (m_cq_ptr, m_cq_size);
+
+		if (m_sq_ptr)
+			munmap (m_sq_ptr, m_sq_size);
+
+		if (m_fd != -1)
+			close (m_fd);
+
+		if (m_br)
+			munmap (m_br, (m_br_mask + 1) * sizeof(io_uring_buf));
+
+		delete [] m_bufs;
+
+		m_fd = -1;
+		m_sq_ptr = m_cq_ptr = NULL;
+		m_sqes = NULL;
+		m_br = NULL;
+		m_bufs = NULL;
+	}
+
+	// next free submission entry, cleared, or NULL when the ring is full
+
+	io_uring_sqe * get_sqe() {
+
+		unsigned head = __atomic_load_n (m_sq_khead, __ATOMIC_ACQUIRE);
+
+		if (m_sq_tail - head >= m_sq_entries)
+			return NULL;
+
+		unsigned ix = m_sq_tail & m_sq_mask;
+
+		m_sq_array[ix] = ix;
+
+		m_sq_tail ++;
+
+		memset (&m_sqes[ix], 0, sizeof(io_uring_sqe));
+
+		return &m_sqes[ix];
+	}
+
+	// publish the new entries and hand them to the kernel
+
+	int submit () {
+
+		unsigned n = m_sq_tail - *m_sq_ktail;
+
+		__atomic_store_n (m_sq_ktail, m_sq_tail, __ATOMIC_RELEASE);
+
+		if (!n)
+			return 0;
+
+		return (int) syscall (__NR_io_uring_enter, m_fd, n, 0, 0, NULL, 0);
+	}
+
+	io_uring_cqe * peek_cqe() {
+
+		unsigned head = *m_cq_khead;
+
+		if (head == __atomic_load_n (m_cq_ktail, __ATOMIC_ACQUIRE))
+			return NULL;
+
+		return &m_cqes[head & m_cq_mask];
+	}
+
+	void cqe_seen() {
+
+		__atomic_store_n (m_cq_khead, *m_cq_khead + 1, __ATOMIC_RELEASE);
+	}
+
+	// register count (power of 2) buffers of size bytes as buffer group bgid
+
+	bool setup_buffers (int bgid, unsigned count, int size) {
+
+		m_br = (io_uring_buf_ring*) mmap (NULL, count * sizeof(io_uring_buf), PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+
+		if (m_br == MAP_FAILED) {
+
+			m_br = NULL;
+			return false;
+		}
+
+		m_br_mask = count - 1;
+
+		io_uring_buf_reg reg;
+
+		memset (&reg, 0, sizeof(reg));
+
+		reg.ring_addr = (unsigned long) m_br;
+		reg.ring_entries = count;
+		reg.bgid = bgid;
+
+		if (syscall (__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+
+			munmap (m_br, count * sizeof(io_uring_buf));
+			m_br = NULL;
+			return false;
+		}
+
+		m_bufsize = size;
+		m_bufs = new byte[count * size];
+		m_br_tail = 0;
+
+		for (unsigned i=0; i < count; i++)
+			recycle (i);
+
+		return true;
+	}
+
+	byte * buffer (int bid) const {
+
+		return m_bufs + bid * m_bufsize;
+	}
+
+	// give a buffer back to the kernel
+
+	void recycle (int bid) {
+
+		// index the ring as a plain array, in C++ the header's flexible array member
+		// gets padded away from offset 0. The ring tail overlays bufs[0].resv.
+
+		io_uring_buf *bufs = (io_uring_buf*) m_br;
+
+		io_uring_buf *b = &bufs[m_br_tail & m_br_mask];
+
+		b->addr = (unsigned long) buffer (bid);
+		b->len = m_bufsize;
+		b->bid = bid;
+
+		m_br_tail ++;
+
+		__atomic_store_n (&bufs[0].resv, m_br_tail, __ATOMIC_RELEASE);
+	}
+};
+
+#endif
+
 typedef std::map <std::string, std::string> STRINGMAP;
 
 typedef STRINGMAP::iterator STRINGMAP_ITERATOR;
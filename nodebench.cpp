@@ -0,0 +1,222 @@
+/*
+	Node index benchmark. Compares the dword_map node index in dmrd.h with the
+	g_node_index array it replaced: a pointer for every DMR ID from LOW_DMRID to
+	HIGH_DMRID, each live one to a nodevector of 100 ESSID pointers.
+
+	A third of the node IDs carry an ESSID. "lookup" is independent finds, so cache
+	misses can overlap. "chained" is finds where the next ID depends on the node just
+	found, so they can't. "rss" is the growth of VmRSS while the nodes are inserted,
+	"walk" a housekeeping style visit of every live node.
+
+	Linux only. build using: make -f makedmrd nodebench
+	run: ./nodebench 1000 5000 20000
+*/
+
+#include "dmrd.h"
+#include <time.h>
+
+#define LOW_DMRID 1000000			/* as in dmrd.cpp */
+#define HIGH_DMRID 8000000
+#define LOOKUPS 20000000
+#define CHAINED 5000000
+
+struct node
+{
+	dword			nodeid;
+	char			pad[148];			// about the size of dmrd's node
+};
+
+struct nodevector					// the old index's
+{
+	dword			radioslot;
+	node			*sub[100];
+
+	nodevector() {
+
+		memset (this, 0, sizeof(*this));
+	}
+};
+
+nodevector * g_node_index [HIGH_DMRID-LOW_DMRID];
+
+long rss_kb ()
+{
+	FILE *f = fopen ("/proc/self/status", "r");
+
+	char line[256];
+	long kb = 0;
+
+	while (f && fgets (line, sizeof(line), f)) {
+
+		if (!strncmp (line, "VmRSS:", 6))
+			kb = atol (line + 6);
+	}
+
+	if (f)
+		fclose (f);
+
+	return kb;
+}
+
+double now ()
+{
+	timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+inline node * array_find (dword id)
+{
+	dword dmrid = id > 0xFFFFFF ? id / 100 : id;
+	dword essid = id > 0xFFFFFF ? id % 100 : 0;
+
+	nodevector const *v = g_node_index[dmrid - LOW_DMRID];
+
+	return v ? v->sub[essid] : NULL;
+}
+
+void run (int count, bool bArray)
+{
+	dword *ids = new dword[count];
+	dword *keys = new dword[LOOKUPS];
+	int i;
+
+	srand (1);
+
+	for (i=0; i < count; i++) {
+
+		dword dmrid = LOW_DMRID + rand() % (HIGH_DMRID - LOW_DMRID);
+
+		ids[i] = i % 3 == 0 ? dmrid * 100 + rand() % 100 : dmrid;
+	}
+
+	for (i=0; i < LOOKUPS; i++)
+		keys[i] = ids[rand() % count];
+
+	dword_map<node*> map;
+
+	long before = rss_kb ();
+
+	for (i=0; i < count; i++) {
+
+		node *n = new node;
+
+		n->nodeid = ids[i];
+
+		if (bArray) {
+
+			dword id = ids[i];
+			dword dmrid = id > 0xFFFFFF ? id / 100 : id;
+
+			if (!g_node_index[dmrid - LOW_DMRID])
+				g_node_index[dmrid - LOW_DMRID] = new nodevector;
+
+			g_node_index[dmrid - LOW_DMRID]->sub[id > 0xFFFFFF ? id % 100 : 0] = n;
+		}
+
+		else
+			map.insert (ids[i]) = n;
+	}
+
+	long after = rss_kb ();
+
+	dword sum = 0;
+	double t0 = now ();
+
+	for (i=0; i < LOOKUPS; i++) {
+
+		node *n;
+
+		if (bArray)
+			n = array_find (keys[i]);
+
+		else {
+
+			node **p = map.find (keys[i]);
+
+			n = p ? *p : NULL;
+		}
+
+		if (n)
+			sum += n->nodeid;
+	}
+
+	double t1 = now ();
+
+	dword id = ids[0];
+
+	for (i=0; i < CHAINED; i++) {
+
+		node *n = bArray ? array_find (id) : *map.find (id);
+
+		id = ids[(n->nodeid * 2654435761u + i) % count];
+	}
+
+	double t2 = now ();
+	int live = 0;
+
+	if (bArray) {
+
+		for (int ix=0; ix < HIGH_DMRID-LOW_DMRID; ix++) {
+
+			if (g_node_index[ix]) {
+
+				for (int e=0; e < 100; e++)
+					live += g_node_index[ix]->sub[e] != NULL;
+			}
+		}
+	}
+
+	else {
+
+		for (int ix=0; ix < map.capacity (); ix++)
+			live += map.key (ix) != 0;
+	}
+
+	double t3 = now ();
+
+	printf ("%-6d %s  lookup %5.1f ns  chained %6.1f ns  rss +%6ld kB  walk %7.2f ms  (%d %u)\n", count, bArray ? "array" : "hash ",
+		(t1 - t0) * 1e9 / LOOKUPS, (t2 - t1) * 1e9 / CHAINED, after - before, (t3 - t2) * 1e3, live, (sum + id) & 1);
+
+	for (i=0; i < count; i++) {			// leave the index empty for the next run
+
+		dword dmrid = ids[i] > 0xFFFFFF ? ids[i] / 100 : ids[i];
+
+		if (bArray) {
+
+			delete array_find (ids[i]);
+			delete g_node_index[dmrid - LOW_DMRID];
+			g_node_index[dmrid - LOW_DMRID] = NULL;
+		}
+
+		else {
+
+			node **p = map.find (ids[i]);
+
+			delete *p;
+			*p = NULL;
+		}
+	}
+
+	delete [] keys;
+	delete [] ids;
+}
+
+int main (int argc, char **argv)
+{
+	if (argc < 2) {
+
+		puts ("usage: nodebench nodes ...");
+		return 1;
+	}
+
+	for (int i=1; i < argc; i++) {
+
+		run (atoi (argv[i]), false);
+		run (atoi (argv[i]), true);
+	}
+
+	return 0;
+}